@@ -0,0 +1,124 @@
+//
+// atomic.c - write an output file in place only once it is complete
+// Copyright (C) 1996, 2017 slotek@nym.hush.com
+//
+#include <stdio.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "atomic.h"
+
+/********** symbolic constants **********/
+#define ATOMIC_EXT          ".tmp"      // temp file: output path + ext
+
+/********** globals **********/
+static char tmp_path[ PATH_MAX ];       // open atomic output
+static char out_path[ PATH_MAX ];
+
+//
+// Create temp file next to path
+//
+// The temp name is fixed, so a run killed before atomic_abort() leaves
+// at most one stale temp file per output, and the retry reuses it.
+//
+int atomic_create( char *path )
+{
+    int fd;
+
+    if ( snprintf( tmp_path, sizeof( tmp_path ), "%s%s", path,
+        ATOMIC_EXT ) >= (int) sizeof( tmp_path ) )
+            return -1;
+    snprintf( out_path, sizeof( out_path ), "%s", path );
+
+    if ( ( fd = open( tmp_path, O_RDWR | O_CREAT | O_TRUNC,
+        S_IREAD | S_IWRITE ) ) == -1 )
+            tmp_path[ 0 ] = '\0';
+
+    return fd;
+}
+
+//
+// Size temp file to len and map it, so output is encoded in place
+// Blocks are allocated now, so a full disk fails here rather than with
+// SIGBUS on a store into the mapping. Where posix_fallocate() is missing
+// (macOS) return NULL and let the caller write() the output instead.
+//
+void *atomic_map( int fd, long len )
+{
+#if defined( _POSIX_ADVISORY_INFO ) && _POSIX_ADVISORY_INFO > 0
+    void *map;
+
+    if ( ftruncate( fd, len ) == -1 || posix_fallocate( fd, 0, len ) )
+        return NULL;
+
+    map = mmap( NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+
+    return ( map == MAP_FAILED ) ? NULL : map;
+#else
+    (void) fd;
+    (void) len;
+
+    return NULL;
+#endif
+}
+
+//
+// Flush and unmap temp file mapping
+//
+int atomic_unmap( void *map, long len )
+{
+    int error = msync( map, len, MS_SYNC );
+
+    munmap( map, len );
+
+    return error ? -1 : 0;
+}
+
+//
+// Sync temp file and rename it into place, then sync the directory so
+// the rename survives a crash too
+//
+int atomic_commit( int fd )
+{
+    int dirfd;
+    char *slash;
+
+    if ( fsync( fd ) == -1 ) {
+        close( fd );
+        atomic_abort();
+        return -1;
+    }
+    close( fd );
+
+    if ( rename( tmp_path, out_path ) == -1 ) {
+        atomic_abort();
+        return -1;
+    }
+    tmp_path[ 0 ] = '\0';
+
+    if ( ( slash = strrchr( out_path, '/' ) ) != NULL )
+        *( slash == out_path ? slash + 1 : slash ) = '\0';
+    else
+        strcpy( out_path, "." );
+
+    if ( ( dirfd = open( out_path, O_RDONLY ) ) != -1 ) {
+        fsync( dirfd );
+        close( dirfd );
+    }
+
+    return 0;
+}
+
+//
+// Remove temp file, if any
+//
+void atomic_abort( void )
+{
+    if ( tmp_path[ 0 ] )
+        unlink( tmp_path );
+    tmp_path[ 0 ] = '\0';
+}
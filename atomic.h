@@ -0,0 +1,32 @@
+//
+// atomic.h - write an output file in place only once it is complete
+// Copyright (C) 1996, 2017 slotek@nym.hush.com
+//
+// Outputs are written to a temp file next to their path and renamed
+// into place, so a reader never sees a partial file and a failed or
+// killed run never leaves one behind under the real name.
+//
+#ifndef ATOMIC_H
+#define ATOMIC_H
+
+/********** prototypes **********/
+//
+// Create a temp file next to path (path + ".tmp", truncated if left over
+// from a killed run) and return its descriptor, or -1. atomic_commit()
+// syncs, closes and renames it to path; atomic_abort() removes it
+// (called from fatal() so no partial output is left behind). One output
+// may be open at a time.
+//
+int atomic_create( char *path );
+int atomic_commit( int fd );
+void atomic_abort( void );
+
+//
+// Size the temp file to len bytes and map it shared and writable, or
+// return NULL (the caller then falls back to write()). atomic_unmap()
+// flushes and unmaps it before atomic_commit(); returns -1 on error.
+//
+void *atomic_map( int fd, long len );
+int atomic_unmap( void *map, long len );
+
+#endif
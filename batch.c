@@ -0,0 +1,468 @@
+//
+// batch.c - resumable bulk conversion with a progress journal
+// Copyright (C) 1996, 2017 slotek@nym.hush.com
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "batch.h"
+#include "pipe.h"
+
+/********** symbolic constants **********/
+#define HASH_DIGITS         16
+#define FNV_INIT            0xcbf29ce484222325ULL
+#define LINE_LEN            ( PATH_MAX + 32 )
+
+/********** typedefs **********/
+typedef struct {
+    uint64_t hash;
+    int ok;                         // status was OK rather than FAIL
+    char *path;
+} entry_t;
+
+typedef struct {
+    int fd;
+    char *text;                     // journal contents, paths point into it
+    entry_t *entries;               // sorted by path, then hash
+    int nentries;
+} journal_t;
+
+typedef struct {
+    char *path;                     // output path of an input
+    int input;                      // index of the input
+} out_t;
+
+typedef struct {
+    pid_t pid;                      // 0 if slot unused
+    char *input;
+    uint64_t hash;
+} job_t;
+
+/********** prototypes **********/
+static int journal_open( journal_t *j, char *path );
+static void journal_close( journal_t *j );
+static entry_t *journal_find( journal_t *j, char *input, uint64_t hash );
+static int output_exists( char *outdir, char *input, char **exts );
+static int find_clashes( char *outdir, int argc, char **argv, char **exts,
+    int *clash );
+static int compare_outs( const void *a, const void *b );
+static int journal_append( journal_t *j, char *input, uint64_t hash,
+    char *status );
+static int compare_entries( const void *a, const void *b );
+static int reap( journal_t *j, job_t *job, int jobs );
+static uint64_t fnv1a( uint64_t h, unsigned char *buf, long len );
+static void prefetch( char *path );
+
+/************************* Batch Driver *************************/
+
+//
+// Convert inputs in child processes, skipping those already journalled
+// as OK whose output is still there
+//
+// Outputs are named after the input's base name, so an input whose
+// output would replace an earlier input's fails instead.
+//
+int batch_run( char *path, char *outdir, int argc, char **argv,
+    char **exts, int (*convert)( char *input, char *outdir ) )
+{
+    int i, slot, running = 0, failed = 0;
+    long jobs = sysconf( _SC_NPROCESSORS_ONLN );
+    uint64_t hash;
+    pid_t pid;
+    job_t *job;
+    int *clash = NULL;
+    journal_t j;
+
+    if ( jobs < 1 )
+        jobs = 1;
+    if ( journal_open( &j, path ) )
+        return -1;
+    if ( ( job = (job_t *) calloc( jobs, sizeof( job_t ) ) ) == NULL ||
+         ( clash = (int *) malloc( argc * sizeof( int ) + 1 ) ) == NULL ||
+         find_clashes( outdir, argc, argv, exts, clash ) ) {
+            free( clash );
+            free( job );
+            journal_close( &j );
+            return -1;
+    }
+
+    for ( i = 0; i < argc; i++ ) {
+
+        //
+        // Start loading the next input while this one is converted
+        //
+        if ( i + 1 < argc )
+            prefetch( argv[ i + 1 ] );
+
+        if ( clash[ i ] != -1 ) {
+            printf( "%s: FAIL same output name as %s\n", argv[ i ],
+                argv[ clash[ i ] ] );
+            ++failed;
+            continue;
+        }
+        if ( batch_hash( argv[ i ], &hash ) ) {
+            printf( "%s: FAIL cannot read\n", argv[ i ] );
+            ++failed;
+            continue;
+        }
+        if ( journal_find( &j, argv[ i ], hash ) != NULL &&
+             output_exists( outdir, argv[ i ], exts ) ) {
+                printf( "%s: SKIP OK in journal\n", argv[ i ] );
+                continue;
+        }
+
+        if ( running == jobs ) {
+            failed += reap( &j, job, jobs );
+            --running;
+        }
+        for ( slot = 0; job[ slot ].pid; slot++ )
+            ;
+
+        fflush( stdout );
+        switch ( pid = fork() ) {
+            case -1:
+                printf( "%s: FAIL cannot fork\n", argv[ i ] );
+                ++failed;
+                break;
+            case 0:
+                exit( convert( argv[ i ], outdir ) );
+                break;
+            default:
+                job[ slot ].pid = pid;
+                job[ slot ].input = argv[ i ];
+                job[ slot ].hash = hash;
+                ++running;
+                break;
+        }
+    }
+
+    while ( running-- > 0 )
+        failed += reap( &j, job, jobs );
+
+    free( clash );
+    free( job );
+    journal_close( &j );
+
+    return failed;
+}
+
+//
+// Wait for a child and journal its result
+// Returns 1 if the input failed
+//
+static int reap( journal_t *j, job_t *job, int jobs )
+{
+    int slot, status;
+    pid_t pid;
+
+    do {
+        pid = wait( &status );
+        for ( slot = 0; slot < jobs && job[ slot ].pid != pid; slot++ )
+            ;
+    } while ( pid != -1 && slot == jobs );
+
+    if ( pid == -1 )
+        return 1;
+    job[ slot ].pid = 0;
+
+    //
+    // Killed children (OOM, ^C) are left out of the journal and retried
+    //
+    if ( !WIFEXITED( status ) ) {
+        printf( "%s: FAIL killed by signal %d\n", job[ slot ].input,
+            WTERMSIG( status ) );
+        return 1;
+    }
+
+    if ( journal_append( j, job[ slot ].input, job[ slot ].hash,
+        WEXITSTATUS( status ) ? "FAIL" : "OK" ) )
+            printf( "%s: journal write error\n", job[ slot ].input );
+
+    return WEXITSTATUS( status ) != 0;
+}
+
+//
+// Hash file contents
+//
+int batch_hash( char *path, uint64_t *hash )
+{
+    int fd;
+    long n;
+    unsigned char buf[ 65536 ];
+
+    if ( ( fd = open( path, O_RDONLY ) ) == -1 )
+        return -1;
+
+    *hash = FNV_INIT;
+    while ( ( n = read( fd, buf, sizeof( buf ) ) ) > 0 )
+        *hash = fnv1a( *hash, buf, n );
+
+    close( fd );
+
+    return ( n == 0 ) ? 0 : -1;
+}
+
+//
+// Ask for a file to be read into the page cache in the background
+//
+static void prefetch( char *path )
+{
+    int fd;
+
+    if ( ( fd = open( path, O_RDONLY ) ) != -1 ) {
+        pipe_readahead( fd );
+        close( fd );
+    }
+}
+
+//
+// Build output path under outdir
+//
+void batch_out_path( char *dest, int len, char *outdir, char *input,
+    char *ext )
+{
+    char *base, *dot;
+
+    if ( ( base = strrchr( input, '/' ) ) != NULL )
+        input = base + 1;
+
+    snprintf( dest, len, "%s/%s", outdir, input );
+
+    base = strrchr( dest, '/' ) + 1;
+    if ( ( dot = strrchr( base, '.' ) ) == NULL )
+        dot = base + strlen( base );
+    if ( dot - dest + strlen( ext ) < (size_t) len )
+        strcpy( dot, ext );
+}
+
+/************************* Journal *************************/
+
+//
+// Load journal entries and open it for appending
+//
+static int journal_open( journal_t *j, char *path )
+{
+    struct stat st;
+    char *p, *end, *nl;
+    int max = 0;
+
+    memset( j, 0, sizeof( journal_t ) );
+
+    if ( ( j->fd = open( path, O_RDWR | O_CREAT | O_APPEND,
+        S_IREAD | S_IWRITE ) ) == -1 )
+            return -1;
+
+    if ( fstat( j->fd, &st ) == -1 ||
+        ( j->text = (char *) malloc( st.st_size + 1 ) ) == NULL ||
+        read( j->fd, j->text, st.st_size ) != st.st_size ) {
+            journal_close( j );
+            return -1;
+    }
+    j->text[ st.st_size ] = '\0';
+
+    //
+    // A line cut short by a crash is ignored, and ended so the next
+    // append starts on a line of its own
+    //
+    if ( st.st_size && j->text[ st.st_size - 1 ] != '\n' &&
+        write( j->fd, "\n", 1 ) != 1 ) {
+            journal_close( j );
+            return -1;
+    }
+
+    for ( p = j->text, end = j->text + st.st_size; p < end; p = nl + 1 ) {
+        if ( ( nl = memchr( p, '\n', end - p ) ) == NULL )
+            break;
+        *nl = '\0';
+
+        if ( nl - p < HASH_DIGITS + 4 || p[ HASH_DIGITS ] != ' ' ||
+            ( strncmp( p + HASH_DIGITS + 1, "OK ", 3 ) &&
+              strncmp( p + HASH_DIGITS + 1, "FAIL ", 5 ) ) )
+                continue;
+
+        if ( j->nentries == max ) {
+            entry_t *e;
+
+            max = max ? max * 2 : 256;
+            if ( ( e = (entry_t *) realloc( j->entries,
+                max * sizeof( entry_t ) ) ) == NULL ) {
+                    journal_close( j );
+                    return -1;
+            }
+            j->entries = e;
+        }
+
+        j->entries[ j->nentries ].hash = strtoull( p, NULL, 16 );
+        j->entries[ j->nentries ].ok = p[ HASH_DIGITS + 1 ] == 'O';
+        j->entries[ j->nentries ].path =
+            strchr( p + HASH_DIGITS + 1, ' ' ) + 1;
+        ++j->nentries;
+    }
+
+    qsort( j->entries, j->nentries, sizeof( entry_t ), compare_entries );
+
+    return 0;
+}
+
+//
+// Free journal
+//
+static void journal_close( journal_t *j )
+{
+    if ( j->fd != -1 )
+        close( j->fd );
+    free( j->entries );
+    free( j->text );
+}
+
+//
+// Find OK journal entry for input with this hash, or NULL
+//
+static entry_t *journal_find( journal_t *j, char *input, uint64_t hash )
+{
+    entry_t key, *e, *end = j->entries + j->nentries;
+
+    key.hash = hash;
+    key.path = input;
+
+    if ( ( e = (entry_t *) bsearch( &key, j->entries, j->nentries,
+        sizeof( entry_t ), compare_entries ) ) == NULL )
+            return NULL;
+
+    //
+    // An input retried after a FAIL has several entries; any OK one counts
+    //
+    while ( e > j->entries && compare_entries( e - 1, &key ) == 0 )
+        --e;
+    for ( ; e < end && compare_entries( e, &key ) == 0; e++ )
+        if ( e->ok )
+            return e;
+
+    return NULL;
+}
+
+//
+// Return 1 if an output of input exists under outdir
+//
+static int output_exists( char *outdir, char *input, char **exts )
+{
+    char out[ PATH_MAX ];
+    struct stat st;
+
+    for ( ; *exts; exts++ ) {
+        batch_out_path( out, sizeof( out ), outdir, input, *exts );
+        if ( stat( out, &st ) == 0 )
+            return 1;
+    }
+
+    return 0;
+}
+
+//
+// Find inputs whose output would replace an earlier input's; clash[ i ]
+// is set to the index of that earlier input, or -1
+// Returns -1 if out of memory
+//
+// The output extension follows from the input, so inputs clash when
+// their outputs with the first of exts do.
+//
+static int find_clashes( char *outdir, int argc, char **argv, char **exts,
+    int *clash )
+{
+    char out[ PATH_MAX ];
+    int i, status = 0;
+    out_t *outs;
+
+    if ( ( outs = (out_t *) calloc( argc + 1, sizeof( out_t ) ) ) == NULL )
+        return -1;
+
+    for ( i = 0; i < argc; i++ ) {
+        batch_out_path( out, sizeof( out ), outdir, argv[ i ], exts[ 0 ] );
+        if ( ( outs[ i ].path = strdup( out ) ) == NULL )
+            status = -1;
+        outs[ i ].input = i;
+        clash[ i ] = -1;
+    }
+
+    if ( status == 0 ) {
+        qsort( outs, argc, sizeof( out_t ), compare_outs );
+        for ( i = 1; i < argc; i++ )
+            if ( strcmp( outs[ i ].path, outs[ i - 1 ].path ) == 0 )
+                clash[ outs[ i ].input ] = outs[ i - 1 ].input;
+    }
+
+    for ( i = 0; i < argc; i++ )
+        free( outs[ i ].path );
+    free( outs );
+
+    return status;
+}
+
+//
+// Append one line and make it durable before going on
+//
+static int journal_append( journal_t *j, char *input, uint64_t hash,
+    char *status )
+{
+    char line[ LINE_LEN ];
+    int n;
+
+    n = snprintf( line, sizeof( line ), "%016llx %s %s\n",
+        (unsigned long long) hash, status, input );
+    if ( n >= (int) sizeof( line ) )
+        return -1;
+
+    if ( write( j->fd, line, n ) != n || fsync( j->fd ) == -1 )
+        return -1;
+
+    return 0;
+}
+
+//
+// qsort() / bsearch() comparison of entries by path, then hash
+//
+static int compare_entries( const void *a, const void *b )
+{
+    entry_t *x = (entry_t *) a, *y = (entry_t *) b;
+    int n;
+
+    if ( ( n = strcmp( x->path, y->path ) ) != 0 )
+        return n;
+
+    return ( x->hash > y->hash ) - ( x->hash < y->hash );
+}
+
+//
+// qsort() comparison of outputs by path, then input order
+//
+static int compare_outs( const void *a, const void *b )
+{
+    out_t *x = (out_t *) a, *y = (out_t *) b;
+    int n;
+
+    if ( ( n = strcmp( x->path, y->path ) ) != 0 )
+        return n;
+
+    return x->input - y->input;
+}
+
+//
+// FNV-1a hash
+//
+static uint64_t fnv1a( uint64_t h, unsigned char *buf, long len )
+{
+    long i;
+
+    for ( i = 0; i < len; i++ ) {
+        h ^= buf[ i ];
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
@@ -0,0 +1,45 @@
+//
+// batch.h - resumable bulk conversion with a progress journal
+// Copyright (C) 1996, 2017 slotek@nym.hush.com
+//
+// A batch converts each input in its own child process, so a fatal()
+// on one image does not end the job. When a child exits, a line with
+// the input's hash, status and path is appended to the journal:
+//
+//     <16 hex digit FNV-1a hash> OK|FAIL <input path>
+//
+// On restart, inputs whose path and hash are journalled as OK are
+// skipped, as long as their output is still there. FAIL entries and
+// children killed by a signal (which are not journalled) are retried.
+// Outputs are written to a temp file and renamed into place. An input
+// whose output name is the same as an earlier input's fails.
+//
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdint.h>
+
+/********** prototypes **********/
+//
+// Convert inputs with convert(input, outdir), running one child per CPU
+// and journalling results in path. exts is the NULL terminated list of
+// extensions convert() may give an output (see batch_out_path()).
+// Returns the number of inputs that failed or could not be read, or -1
+// if the journal cannot be opened.
+//
+int batch_run( char *path, char *outdir, int argc, char **argv,
+    char **exts, int (*convert)( char *input, char *outdir ) );
+
+//
+// FNV-1a hash of a file's contents. Returns -1 if it cannot be read.
+//
+int batch_hash( char *path, uint64_t *hash );
+
+//
+// Copy base name of input into dest (len bytes) under outdir, replacing
+// its extension with ext
+//
+void batch_out_path( char *dest, int len, char *outdir, char *input,
+    char *ext );
+
+#endif
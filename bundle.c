@@ -0,0 +1,673 @@
+//
+// bundle.c - many DSK and NIB images packed into one file
+// Copyright (C) 1996, 2017 slotek@nym.hush.com
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "atomic.h"
+#include "bundle.h"
+#include "codec.h"
+
+/********** symbolic constants **********/
+#define HASH_INIT_SIZE      4096    // initial hash slots, power of 2
+#define NO_BLOCK            0xffffffffU
+
+/********** typedefs **********/
+struct bundle {
+    int fd;
+
+    //
+    // Writer state
+    //
+    uint32_t nblocks;
+    uint32_t hash_size;
+    uint64_t *hash_keys;
+    uint32_t *hash_blocks;
+    bundle_entry_t *entries;
+    uint32_t nentries, max_entries;
+    uint32_t *map;
+    uint32_t nmap, max_map;
+    char *names;
+    uint32_t names_len, max_names;
+
+    //
+    // Reader state
+    //
+    uchar *base;
+    size_t len;
+    bundle_header_t *header;
+    bundle_entry_t *index;
+    uint32_t *index_map;
+    char *index_names;
+};
+
+/********** prototypes **********/
+static uint64_t hash_block( uchar *block );
+static int hash_grow( bundle_t *bundle );
+static long add_block( bundle_t *bundle, uchar *block );
+static int add_entry( bundle_t *bundle, char *name, int kind, int volume );
+static int grow( void **ptr, uint32_t *max, uint32_t need, size_t size );
+static int compare_entries( const void *a, const void *b );
+static int check_index( bundle_t *bundle );
+static uchar *block_ptr( bundle_t *bundle, uint32_t block );
+static void bundle_free( bundle_t *bundle );
+
+/************************* Writer *************************/
+
+//
+// Create bundle file
+// It is written to a temp file that bundle_finish() renames into place
+//
+bundle_t *bundle_create( char *path )
+{
+    bundle_t *bundle;
+
+    if ( ( bundle = (bundle_t *) calloc( 1, sizeof( bundle_t ) ) ) == NULL )
+        return NULL;
+
+    if ( ( bundle->fd = atomic_create( path ) ) == -1 ) {
+        free( bundle );
+        return NULL;
+    }
+
+    if ( hash_grow( bundle ) ) {
+        bundle_free( bundle );
+        atomic_abort();
+        return NULL;
+    }
+
+    return bundle;
+}
+
+//
+// Add a DSK or NIB image
+//
+int bundle_add( bundle_t *bundle, char *name, uchar *image, long len )
+{
+    int trk = 0, volume, first_volume = -1;
+    uint32_t i;
+    long block;
+    geom_t *geom;
+    static uchar dsk[ DSK_LEN ];
+    uchar nib[ BYTES_PER_NIB_TRACK ];
+
+    if ( len == DSK_LEN || len == D13_LEN )
+        return bundle_add_sectors( bundle, name, image,
+            ( len == DSK_LEN ) ? BUNDLE_DSK : BUNDLE_D13, DEFAULT_VOLUME );
+
+    if ( len != NIB_LEN )
+        return -1;
+
+    //
+    // Keep NIB as sectors only if re-encoding gives back the same bytes
+    //
+    if ( ( geom = nib_track_geom( image ) ) != NULL ) {
+        for ( trk = 0; trk < TRACKS_PER_DISK; trk++ ) {
+            uchar *src = image + trk * BYTES_PER_NIB_TRACK;
+            uchar *dest = dsk + trk * geom->sectors * BYTES_PER_SECTOR;
+
+            if ( nib_decode_track( geom, dest, src, trk, &volume ) )
+                break;
+            if ( first_volume == -1 )
+                first_volume = volume;
+            if ( volume != first_volume )
+                break;
+            nib_encode_track( geom, nib, dest, volume, trk );
+            if ( memcmp( nib, src, BYTES_PER_NIB_TRACK ) )
+                break;
+        }
+    }
+
+    if ( trk == TRACKS_PER_DISK )
+        return bundle_add_sectors( bundle, name, dsk,
+            ( geom == &geom_16 ) ? BUNDLE_NIB : BUNDLE_NIB13, first_volume );
+
+    //
+    // Otherwise keep raw NIB blocks
+    //
+    if ( add_entry( bundle, name, BUNDLE_RAW, 0 ) )
+        return -1;
+
+    for ( i = 0; i < BUNDLE_NIB_BLOCKS; i++ ) {
+        if ( ( block = add_block( bundle, image + i * BUNDLE_BLOCK_LEN ) )
+            == -1 )
+                return -1;
+        bundle->map[ bundle->nmap++ ] = block;
+    }
+
+    return 0;
+}
+
+//
+// Add an image given as DSK image sectors
+//
+int bundle_add_sectors( bundle_t *bundle, char *name, uchar *dsk,
+    int kind, int volume )
+{
+    int i, n = bundle_kind_blocks( kind );
+    long block;
+
+    if ( add_entry( bundle, name, kind, volume ) )
+        return -1;
+
+    for ( i = 0; i < n; i++ ) {
+        if ( ( block = add_block( bundle, dsk + i * BUNDLE_BLOCK_LEN ) )
+            == -1 )
+                return -1;
+        bundle->map[ bundle->nmap++ ] = block;
+    }
+
+    return 0;
+}
+
+//
+// Return 1 if an image of this name has been added
+// A linear search, but only bundle_add*() call it, once per image
+//
+int bundle_added( bundle_t *bundle, char *name )
+{
+    uint32_t i;
+
+    for ( i = 0; i < bundle->nentries; i++ )
+        if ( strcmp( bundle->names + bundle->entries[ i ].name, name ) == 0 )
+            return 1;
+
+    return 0;
+}
+
+//
+// Write index and header and close bundle
+//
+static bundle_t *sort_bundle;
+int bundle_finish( bundle_t *bundle )
+{
+    int status = 0;
+    uint32_t i;
+    bundle_header_t header;
+    off_t offset;
+
+    sort_bundle = bundle;
+    qsort( bundle->entries, bundle->nentries, sizeof( bundle_entry_t ),
+        compare_entries );
+
+    memset( &header, 0, sizeof( header ) );
+    memcpy( header.magic, BUNDLE_MAGIC, sizeof( BUNDLE_MAGIC ) );
+    header.version = BUNDLE_VERSION;
+    header.nimages = bundle->nentries;
+    header.nblocks = bundle->nblocks;
+    header.nmap = bundle->nmap;
+    header.names_len = bundle->names_len;
+    header.index = BUNDLE_HEADER_LEN +
+        (uint64_t) bundle->nblocks * BUNDLE_BLOCK_LEN;
+
+    offset = header.index;
+    i = bundle->nentries * sizeof( bundle_entry_t );
+    if ( pwrite( bundle->fd, bundle->entries, i, offset ) != i )
+        status = -1;
+    offset += i;
+    i = bundle->nmap * sizeof( uint32_t );
+    if ( pwrite( bundle->fd, bundle->map, i, offset ) != i )
+        status = -1;
+    offset += i;
+    i = bundle->names_len;
+    if ( pwrite( bundle->fd, bundle->names, i, offset ) != i )
+        status = -1;
+
+    if ( pwrite( bundle->fd, &header, sizeof( header ), 0 ) !=
+        sizeof( header ) )
+            status = -1;
+
+    if ( status == 0 )
+        status = atomic_commit( bundle->fd );
+    else {
+        close( bundle->fd );
+        atomic_abort();
+    }
+    bundle->fd = -1;
+
+    bundle_free( bundle );
+
+    return status;
+}
+
+//
+// Return block number of a block, appending it to the pool if new
+//
+static long add_block( bundle_t *bundle, uchar *block )
+{
+    uint64_t key = hash_block( block );
+    uint32_t i, mask = bundle->hash_size - 1;
+    uchar copy[ BUNDLE_BLOCK_LEN ];
+    off_t offset;
+
+    for ( i = key & mask; bundle->hash_blocks[ i ] != NO_BLOCK;
+        i = ( i + 1 ) & mask ) {
+
+        if ( bundle->hash_keys[ i ] != key )
+            continue;
+
+        offset = BUNDLE_HEADER_LEN +
+            (off_t) bundle->hash_blocks[ i ] * BUNDLE_BLOCK_LEN;
+        if ( pread( bundle->fd, copy, BUNDLE_BLOCK_LEN, offset ) !=
+            BUNDLE_BLOCK_LEN )
+                return -1;
+        if ( memcmp( copy, block, BUNDLE_BLOCK_LEN ) == 0 )
+            return bundle->hash_blocks[ i ];
+    }
+
+    offset = BUNDLE_HEADER_LEN + (off_t) bundle->nblocks * BUNDLE_BLOCK_LEN;
+    if ( pwrite( bundle->fd, block, BUNDLE_BLOCK_LEN, offset ) !=
+        BUNDLE_BLOCK_LEN )
+            return -1;
+
+    bundle->hash_keys[ i ] = key;
+    bundle->hash_blocks[ i ] = bundle->nblocks;
+
+    if ( ++bundle->nblocks * 2 > bundle->hash_size && hash_grow( bundle ) )
+        return -1;
+
+    return bundle->nblocks - 1;
+}
+
+//
+// Start a new entry with room for a full image in the map
+// Names must be unique, as bundle_find() returns only one match
+//
+static int add_entry( bundle_t *bundle, char *name, int kind, int volume )
+{
+    bundle_entry_t *entry;
+    uint32_t len = strlen( name ) + 1;
+
+    if ( bundle_added( bundle, name ) ||
+         grow( (void **) &bundle->entries, &bundle->max_entries,
+            bundle->nentries + 1, sizeof( bundle_entry_t ) ) ||
+         grow( (void **) &bundle->map, &bundle->max_map,
+            bundle->nmap + BUNDLE_NIB_BLOCKS, sizeof( uint32_t ) ) ||
+         grow( (void **) &bundle->names, &bundle->max_names,
+            bundle->names_len + len, 1 ) )
+                return -1;
+
+    entry = &bundle->entries[ bundle->nentries++ ];
+    entry->name = bundle->names_len;
+    entry->kind = kind;
+    entry->volume = volume;
+    entry->map = bundle->nmap;
+
+    memcpy( bundle->names + bundle->names_len, name, len );
+    bundle->names_len += len;
+
+    return 0;
+}
+
+//
+// Double hash table size (or allocate it) and rehash
+//
+static int hash_grow( bundle_t *bundle )
+{
+    uint32_t i, j, size, mask;
+    uint64_t *keys;
+    uint32_t *blocks;
+
+    size = bundle->hash_size ? bundle->hash_size * 2 : HASH_INIT_SIZE;
+    mask = size - 1;
+
+    keys = (uint64_t *) malloc( size * sizeof( uint64_t ) );
+    blocks = (uint32_t *) malloc( size * sizeof( uint32_t ) );
+    if ( keys == NULL || blocks == NULL ) {
+        free( keys );
+        free( blocks );
+        return -1;
+    }
+    memset( blocks, 0xff, size * sizeof( uint32_t ) );
+
+    for ( i = 0; i < bundle->hash_size; i++ ) {
+        if ( bundle->hash_blocks[ i ] == NO_BLOCK )
+            continue;
+        for ( j = bundle->hash_keys[ i ] & mask; blocks[ j ] != NO_BLOCK;
+            j = ( j + 1 ) & mask )
+                ;
+        keys[ j ] = bundle->hash_keys[ i ];
+        blocks[ j ] = bundle->hash_blocks[ i ];
+    }
+
+    free( bundle->hash_keys );
+    free( bundle->hash_blocks );
+    bundle->hash_keys = keys;
+    bundle->hash_blocks = blocks;
+    bundle->hash_size = size;
+
+    return 0;
+}
+
+//
+// FNV-1a hash of a block
+//
+static uint64_t hash_block( uchar *block )
+{
+    int i;
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for ( i = 0; i < BUNDLE_BLOCK_LEN; i++ ) {
+        h ^= block[ i ];
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+//
+// Make room for need elements of size bytes in a growable array
+//
+static int grow( void **ptr, uint32_t *max, uint32_t need, size_t size )
+{
+    uint32_t n;
+    void *p;
+
+    if ( need <= *max )
+        return 0;
+
+    for ( n = *max ? *max : 64; n < need; n *= 2 )
+        ;
+    if ( ( p = realloc( *ptr, (size_t) n * size ) ) == NULL )
+        return -1;
+
+    *ptr = p;
+    *max = n;
+
+    return 0;
+}
+
+//
+// qsort() comparison of entries by name
+//
+static int compare_entries( const void *a, const void *b )
+{
+    return strcmp( sort_bundle->names + ( (bundle_entry_t *) a )->name,
+        sort_bundle->names + ( (bundle_entry_t *) b )->name );
+}
+
+/************************* Reader *************************/
+
+//
+// Open and map bundle file
+//
+bundle_t *bundle_open( char *path )
+{
+    bundle_t *bundle;
+    bundle_header_t *h;
+    struct stat st;
+    uint64_t need;
+
+    if ( ( bundle = (bundle_t *) calloc( 1, sizeof( bundle_t ) ) ) == NULL )
+        return NULL;
+
+    if ( ( bundle->fd = open( path, O_RDONLY ) ) == -1 ) {
+        free( bundle );
+        return NULL;
+    }
+
+    if ( fstat( bundle->fd, &st ) == -1 || st.st_size < BUNDLE_HEADER_LEN ) {
+        bundle_free( bundle );
+        return NULL;
+    }
+
+    bundle->len = st.st_size;
+    bundle->base = mmap( NULL, bundle->len, PROT_READ, MAP_SHARED,
+        bundle->fd, 0 );
+    if ( bundle->base == MAP_FAILED ) {
+        bundle->base = NULL;
+        bundle_free( bundle );
+        return NULL;
+    }
+
+    //
+    // Validate header and index bounds
+    //
+    h = bundle->header = (bundle_header_t *) bundle->base;
+    need = h->index + (uint64_t) h->nimages * sizeof( bundle_entry_t ) +
+        (uint64_t) h->nmap * sizeof( uint32_t ) + h->names_len;
+    if ( memcmp( h->magic, BUNDLE_MAGIC, sizeof( BUNDLE_MAGIC ) ) ||
+         h->version != BUNDLE_VERSION ||
+         h->index != BUNDLE_HEADER_LEN +
+            (uint64_t) h->nblocks * BUNDLE_BLOCK_LEN ||
+         need > bundle->len ) {
+            bundle_free( bundle );
+            return NULL;
+    }
+
+    bundle->index = (bundle_entry_t *) ( bundle->base + h->index );
+    bundle->index_map = (uint32_t *) ( bundle->index + h->nimages );
+    bundle->index_names = (char *) ( bundle->index_map + h->nmap );
+
+    if ( check_index( bundle ) ) {
+        bundle_free( bundle );
+        return NULL;
+    }
+
+    return bundle;
+}
+
+//
+// Check that entries, names and block numbers stay inside the bundle
+//
+static int check_index( bundle_t *bundle )
+{
+    bundle_header_t *h = bundle->header;
+    bundle_entry_t *entry;
+    uint32_t i, n;
+
+    if ( h->names_len == 0 || bundle->index_names[ h->names_len - 1 ] )
+        return h->nimages ? -1 : 0;
+
+    for ( i = 0; i < h->nimages; i++ ) {
+        entry = &bundle->index[ i ];
+        if ( entry->kind > BUNDLE_NIB13 )
+            return -1;
+        n = bundle_kind_blocks( entry->kind );
+        if ( entry->name >= h->names_len ||
+             entry->map > h->nmap || h->nmap - entry->map < n )
+                return -1;
+    }
+
+    for ( i = 0; i < h->nmap; i++ )
+        if ( bundle->index_map[ i ] >= h->nblocks )
+            return -1;
+
+    return 0;
+}
+
+//
+// Unmap and close bundle
+//
+void bundle_close( bundle_t *bundle )
+{
+    bundle_free( bundle );
+}
+
+//
+// Return number of images
+//
+int bundle_count( bundle_t *bundle )
+{
+    return bundle->header->nimages;
+}
+
+//
+// Return number of unique blocks
+//
+int bundle_blocks( bundle_t *bundle )
+{
+    return bundle->header->nblocks;
+}
+
+//
+// Return image entry, or NULL if index is out of range
+//
+bundle_entry_t *bundle_entry( bundle_t *bundle, int index )
+{
+    if ( index < 0 || index >= bundle_count( bundle ) )
+        return NULL;
+
+    return &bundle->index[ index ];
+}
+
+//
+// Return image name, or NULL if index is out of range
+//
+char *bundle_name( bundle_t *bundle, int index )
+{
+    bundle_entry_t *entry;
+
+    if ( ( entry = bundle_entry( bundle, index ) ) == NULL )
+        return NULL;
+
+    return bundle->index_names + entry->name;
+}
+
+//
+// Binary search for image by name, returns -1 if not found
+//
+int bundle_find( bundle_t *bundle, char *name )
+{
+    int lo = 0, hi = bundle_count( bundle ) - 1, mid, cmp;
+
+    while ( lo <= hi ) {
+        mid = ( lo + hi ) / 2;
+        if ( ( cmp = strcmp( name, bundle_name( bundle, mid ) ) ) == 0 )
+            return mid;
+        if ( cmp < 0 )
+            hi = mid - 1;
+        else
+            lo = mid + 1;
+    }
+
+    return -1;
+}
+
+//
+// Return pointer to logical sector
+//
+uchar *bundle_sector( bundle_t *bundle, int index, int track, int sector )
+{
+    bundle_entry_t *entry;
+    geom_t *geom;
+
+    if ( ( entry = bundle_entry( bundle, index ) ) == NULL ||
+        entry->kind == BUNDLE_RAW )
+            return NULL;
+
+    geom = bundle_kind_geom( entry->kind );
+    if ( track < 0 || track >= TRACKS_PER_DISK || sector < 0 ||
+        sector >= geom->sectors )
+            return NULL;
+
+    return block_ptr( bundle, bundle->index_map[ entry->map +
+        track * geom->sectors + sector ] );
+}
+
+//
+// Rebuild image in the requested format
+//
+long bundle_extract( bundle_t *bundle, int index, int format, uchar *buf )
+{
+    bundle_entry_t *entry;
+    uint32_t *map;
+    geom_t *geom;
+    static uchar nib[ NIB_LEN ];
+    uchar track[ BYTES_PER_TRACK ];
+    int i, trk, volume, n, len;
+
+    if ( ( entry = bundle_entry( bundle, index ) ) == NULL )
+        return -1;
+    map = bundle->index_map + entry->map;
+    geom = bundle_kind_geom( entry->kind );
+
+    if ( entry->kind == BUNDLE_RAW ) {
+        uchar *dest = ( format == DISK_NIB ) ? buf : nib;
+
+        for ( i = 0; i < BUNDLE_NIB_BLOCKS; i++ )
+            memcpy( dest + i * BUNDLE_BLOCK_LEN, block_ptr( bundle, map[ i ] ),
+                BUNDLE_BLOCK_LEN );
+        if ( format == DISK_NIB )
+            return NIB_LEN;
+
+        if ( ( geom = nib_track_geom( nib ) ) == NULL )
+            return -1;
+        len = geom->sectors * BYTES_PER_SECTOR;
+        for ( trk = 0; trk < TRACKS_PER_DISK; trk++ )
+            if ( nib_decode_track( geom, buf + trk * len,
+                nib + trk * BYTES_PER_NIB_TRACK, trk, &volume ) )
+                    return -1;
+        return geom->dsk_len;
+    }
+
+    if ( format == DISK_DSK ) {
+        n = bundle_kind_blocks( entry->kind );
+        for ( i = 0; i < n; i++ )
+            memcpy( buf + i * BUNDLE_BLOCK_LEN, block_ptr( bundle, map[ i ] ),
+                BUNDLE_BLOCK_LEN );
+        return geom->dsk_len;
+    }
+
+    for ( trk = 0; trk < TRACKS_PER_DISK; trk++ ) {
+        for ( i = 0; i < geom->sectors; i++ )
+            memcpy( track + i * BYTES_PER_SECTOR,
+                block_ptr( bundle, map[ trk * geom->sectors + i ] ),
+                BYTES_PER_SECTOR );
+        nib_encode_track( geom, buf + trk * BYTES_PER_NIB_TRACK, track,
+            entry->volume, trk );
+    }
+    return NIB_LEN;
+}
+
+//
+// Return geometry of an entry kind
+//
+geom_t *bundle_kind_geom( int kind )
+{
+    return ( kind == BUNDLE_D13 || kind == BUNDLE_NIB13 ) ?
+        &geom_13 : &geom_16;
+}
+
+//
+// Return number of blocks of an entry kind
+//
+int bundle_kind_blocks( int kind )
+{
+    if ( kind == BUNDLE_RAW )
+        return BUNDLE_NIB_BLOCKS;
+
+    return bundle_kind_geom( kind )->dsk_len / BUNDLE_BLOCK_LEN;
+}
+
+//
+// Return pointer to pool block
+//
+static uchar *block_ptr( bundle_t *bundle, uint32_t block )
+{
+    return bundle->base + BUNDLE_HEADER_LEN +
+        (size_t) block * BUNDLE_BLOCK_LEN;
+}
+
+//
+// Release everything held by a bundle
+//
+static void bundle_free( bundle_t *bundle )
+{
+    if ( bundle->base )
+        munmap( bundle->base, bundle->len );
+    if ( bundle->fd != -1 )
+        close( bundle->fd );
+    free( bundle->hash_keys );
+    free( bundle->hash_blocks );
+    free( bundle->entries );
+    free( bundle->map );
+    free( bundle->names );
+    free( bundle );
+}
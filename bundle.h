@@ -0,0 +1,107 @@
+//
+// bundle.h - many DSK and NIB images packed into one file
+// Copyright (C) 1996, 2017 slotek@nym.hush.com
+//
+// A bundle holds a pool of unique 256 byte blocks followed by an index.
+// Each image is a list of block numbers, so identical sectors (blank
+// sectors, DOS tracks, ...) are stored once for the whole bundle. DSK
+// (and D13) images and NIBs with the exact dsk2nib layout are kept as
+// their 560 (or 455) sectors plus volume number for NIBs; any other NIB
+// is kept as its 910 raw blocks. Integers are stored in host byte order.
+//
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <stdint.h>
+
+#include "disk.h"
+
+/********** symbolic constants **********/
+#define BUNDLE_MAGIC        "DSKBNDL"
+#define BUNDLE_VERSION      1
+
+#define BUNDLE_BLOCK_LEN    256
+#define BUNDLE_HEADER_LEN   256     // block pool starts here
+
+#define BUNDLE_DSK          0       // entry kinds: DSK sectors
+#define BUNDLE_NIB          1       // NIB stored as DSK sectors + volume
+#define BUNDLE_RAW          2       // NIB stored as raw blocks
+#define BUNDLE_D13          3       // 13-sector DSK sectors
+#define BUNDLE_NIB13        4       // 13-sector NIB as D13 sectors + volume
+
+#define BUNDLE_DSK_BLOCKS   ( DISK_DSK_LEN / BUNDLE_BLOCK_LEN )
+#define BUNDLE_NIB_BLOCKS   ( DISK_NIB_LEN / BUNDLE_BLOCK_LEN )
+
+/********** typedefs **********/
+typedef struct {
+    char magic[ 8 ];
+    uint32_t version;
+    uint32_t nimages;
+    uint32_t nblocks;               // unique blocks in pool
+    uint32_t nmap;                  // block numbers in map
+    uint32_t names_len;             // bytes in name table
+    uint32_t pad;
+    uint64_t index;                 // offset of entry table
+} bundle_header_t;
+
+typedef struct {
+    uint32_t name;                  // offset into name table
+    uint32_t kind;                  // BUNDLE_DSK, BUNDLE_NIB, ...
+    uint32_t volume;
+    uint32_t map;                   // index of first block number in map
+} bundle_entry_t;
+
+typedef struct bundle bundle_t;
+
+/********** prototypes **********/
+//
+// Writing: create a bundle, add images (DISK_DSK_LEN, DISK_D13_LEN or
+// DISK_NIB_LEN bytes) and finish it, which writes the index sorted by
+// name. All return NULL or -1 on failure; adding a name that is already
+// in the bundle fails (bundle_added() tells). The bundle is written with
+// atomic_create() and only appears under its path once bundle_finish()
+// succeeds.
+//
+bundle_t *bundle_create( char *path );
+int bundle_add( bundle_t *bundle, char *name, unsigned char *image, long len );
+int bundle_add_sectors( bundle_t *bundle, char *name, unsigned char *dsk,
+    int kind, int volume );
+int bundle_added( bundle_t *bundle, char *name );
+int bundle_finish( bundle_t *bundle );
+
+//
+// Reading: the bundle is mmapped, so entries and sectors are returned as
+// pointers into the mapping that stay valid until bundle_close(). An
+// index, track or sector out of range returns NULL (or -1).
+//
+bundle_t *bundle_open( char *path );
+void bundle_close( bundle_t *bundle );
+int bundle_count( bundle_t *bundle );
+int bundle_blocks( bundle_t *bundle );
+bundle_entry_t *bundle_entry( bundle_t *bundle, int index );
+char *bundle_name( bundle_t *bundle, int index );
+int bundle_find( bundle_t *bundle, char *name );
+
+//
+// Return pointer to a logical DSK sector of an image, or NULL for a raw
+// NIB entry or an index, track or sector out of range
+//
+unsigned char *bundle_sector( bundle_t *bundle, int index, int track,
+    int sector );
+
+//
+// Rebuild an image as DISK_DSK or DISK_NIB into buf (DISK_NIB_LEN
+// bytes). Returns the image length (DISK_DSK_LEN, DISK_D13_LEN or
+// DISK_NIB_LEN), or -1 if index is out of range or a raw NIB does not
+// decode.
+//
+long bundle_extract( bundle_t *bundle, int index, int format,
+    unsigned char *buf );
+
+//
+// Return geometry and number of blocks of an entry kind
+//
+geom_t *bundle_kind_geom( int kind );
+int bundle_kind_blocks( int kind );
+
+#endif
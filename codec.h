@@ -0,0 +1,139 @@
+//
+// codec.h - NIB track codec shared by the disk routines and the tools
+// Copyright (C) 1996, 2017 slotek@nym.hush.com
+//
+// Private to this source tree: libdisk.a users see only disk.h and
+// bundle.h.
+//
+#ifndef CODEC_H
+#define CODEC_H
+
+#include "disk.h"
+
+/********** symbolic constants **********/
+#define TRACKS_PER_DISK     DISK_TRACKS
+#define SECTORS_PER_TRACK   16
+#define BYTES_PER_SECTOR    DISK_SECTOR_LEN
+#define BYTES_PER_TRACK     4096
+#define DSK_LEN             DISK_DSK_LEN
+#define D13_LEN             DISK_D13_LEN
+
+#define BYTES_PER_NIB_SECTOR 416
+#define BYTES_PER_NIB_TRACK DISK_NIB_TRACK_LEN
+#define NIB_LEN             DISK_NIB_LEN
+
+#define DEFAULT_VOLUME      DISK_DEFAULT_VOLUME
+
+#define PROLOG_LEN          3
+#define EPILOG_LEN          3
+#define GAP2_LEN            5
+#define GAP_BYTE            0xff
+#define MAX_DATA_LEN        410     // longest encoded data field, excl. checksum
+
+#define NIB_BAD_BYTE        -1      // geom->decode() failures
+#define NIB_BAD_CHECKSUM    -2
+
+/********** typedefs **********/
+typedef unsigned char uchar;
+
+//
+// NIB address field
+//
+typedef struct {
+    uchar prolog[ PROLOG_LEN ];
+    uchar volume[ 2 ];
+    uchar track[ 2 ];
+    uchar sector[ 2 ];
+    uchar checksum[ 2 ];
+    uchar epilog[ EPILOG_LEN ];
+} addr_t;
+
+//
+// geom_t (disk.h) describes the sector codec. In the dsk2nib layout a NIB
+// sector is gap1, addr field, gap2, data prolog, data_len encoded bytes,
+// data checksum and data epilog. encode() turns 256 bytes into data_len
+// bytes and a checksum. decode() does the reverse and returns 0,
+// NIB_BAD_BYTE (dest untouched) or NIB_BAD_CHECKSUM (dest written all the
+// same).
+//
+
+//
+// Sector copy found by the NIB decoder. addr is the offset of the address
+// prolog and data that of the first encoded data byte, from the start of
+// the track (or of the image for nib_decode_image()). status is what
+// geom->decode() returned.
+//
+typedef struct {
+    long addr;
+    long data;
+    int volume;
+    int track;
+    int sector;
+    int status;
+} nib_field_t;
+
+//
+// Decoder statistics, for callers that report on a NIB's condition.
+// Address fields rejected for their checksum, track or sector count as
+// bad_addr, wrong address or data epilogs as bad_epilog, and data fields
+// by their decode status. found(), if set, is called for every data field
+// decoded, bad ones included, in the order they are found.
+//
+typedef struct {
+    int bad_addr;
+    int bad_data;
+    int bad_epilog;
+    int bad_bytes;
+    void (*found)( nib_field_t *field, void *arg );
+    void *arg;
+} nib_stats_t;
+
+/********** globals **********/
+extern uchar nib_addr_epilog[ EPILOG_LEN ];
+extern uchar nib_data_prolog[ PROLOG_LEN ];
+extern uchar nib_data_epilog[ EPILOG_LEN ];
+
+/********** prototypes **********/
+//
+// Track codec used by the disk routines and the converters.
+// nib_encode_track() builds a BYTES_PER_NIB_TRACK byte track with the
+// dsk2nib layout from one DSK track (geom->sectors sectors);
+// nib_decode_track() does the reverse for any NIB track and returns -1
+// unless all sectors were found with good checksums. nib_decode_sectors()
+// decodes whatever sectors it can and returns a bit mask of them (bit n =
+// DSK image sector n); stats may be NULL. *volume is set to the volume
+// number read from the track. A sector only decodes from an address field
+// with a good checksum and the track being decoded; a later good copy
+// replaces an earlier one, and a copy with a bad data checksum is stored
+// (but not found) only while there is no good one.
+//
+void nib_encode_track( geom_t *geom, uchar *nib, uchar *dsk, int volume,
+    int track );
+int nib_decode_track( geom_t *geom, uchar *dsk, uchar *nib, int track,
+    int *volume );
+unsigned nib_decode_sectors( geom_t *geom, uchar *dsk, uchar *nib,
+    int track, int *volume, nib_stats_t *stats );
+
+//
+// Decode a NIB image of non-standard length (no fixed track size) into a
+// whole DSK image by the same rules, filing sectors by the track in their
+// address field. found[] gets the bit mask of each of the
+// TRACKS_PER_DISK tracks.
+//
+void nib_decode_image( geom_t *geom, uchar *dsk, uchar *nib, long len,
+    unsigned *found, nib_stats_t *stats );
+
+//
+// Return the geometry of the first address prolog in a NIB track, or in
+// len NIB bytes, or NULL if there is none
+//
+geom_t *nib_track_geom( uchar *nib );
+geom_t *nib_find_geom( uchar *nib, long len );
+
+//
+// Encode a byte into two "4 and 4" bytes, and back
+//
+void nib_odd_even_encode( uchar a[], int i );
+uchar nib_odd_even_decode( uchar byte1, uchar byte2 );
+
+#endif
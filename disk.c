@@ -0,0 +1,1098 @@
+//
+// disk.c - random access to Apple II DSK and NIB image files
+// Copyright (C) 1996, 2017 slotek@nym.hush.com
+//
+// Tracks are read from the image file, encoded (DSK => NIB) or decoded
+// (NIB => DSK) only when first accessed, and kept in a small LRU cache.
+// Dirty tracks are written back in the image file's own format when they
+// are evicted, or on disk_flush() / disk_close().
+//
+// A NIB opened read-only with a valid sidecar index (see nibidx.h) is
+// decoded from the fields the index lists instead of by a scan.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "codec.h"
+#include "nibidx.h"
+
+/********** symbolic constants **********/
+#define PRIMARY_BUF_LEN     256     // 6+2 buffers
+#define SECONDARY_BUF_LEN   86
+
+#define CHUNK_LEN           51      // 5+3 buffers
+#define TOP_BUF_LEN         256
+#define THREES_BUF_LEN      (CHUNK_LEN*3+1)
+
+#define DATA_SEARCH_LEN     64      // max bytes from addr field to data prolog
+
+/********** typedefs **********/
+//
+// Bit mask of all sectors of a track
+//
+#define ALL_SECTORS( geom ) ( ( 1u << (geom)->sectors ) - 1 )
+
+typedef struct {
+    int track;                          // -1 if slot unused
+    int volume;                         // volume used to encode nib
+    int dsk_valid;
+    int nib_valid;
+    unsigned found;                     // DSK sectors decoded from nib
+    int dirty;
+    unsigned long used;                 // LRU stamp
+    uchar dsk[ BYTES_PER_TRACK ];
+    uchar nib[ BYTES_PER_NIB_TRACK ];
+} track_t;
+
+struct disk {
+    int fd;
+    int format;
+    geom_t *geom;
+    int rw;
+    int volume;
+    int ntracks;
+    unsigned long clock;
+    track_t *cache;
+    nibidx_entry_t *idx;                // sidecar index of a NIB, or NULL
+    uint32_t nidx;
+};
+
+/********** prototypes **********/
+static void nibbilize62( uchar *src, uchar *dest );
+static int denibbilize62( uchar *src, uchar *dest );
+static void nibbilize53( uchar *src, uchar *dest );
+static int denibbilize53( uchar *src, uchar *dest );
+static int decode_fixed( geom_t *geom, uchar *dsk, uchar *nib, int track,
+    int *volume, nib_stats_t *stats );
+static long decode_field( geom_t *geom, uchar *buf, long i, long len,
+    int track, nib_field_t *f, uchar *sec_buf, nib_stats_t *stats );
+static void store_field( geom_t *geom, uchar *dsk, nib_field_t *f,
+    uchar *sec_buf, unsigned *found, int *volume, nib_stats_t *stats );
+static void count_field( nib_field_t *f, nib_stats_t *stats );
+static void load_index( disk_t *disk, char *path, struct stat *st );
+static uchar *track_field( uchar *nib, long start, int len, uchar *buf );
+
+static track_t *get_track( disk_t *disk, int track );
+static void need_dsk( disk_t *disk, track_t *t );
+static void need_nib( disk_t *disk, track_t *t );
+static int write_back( disk_t *disk, track_t *t );
+static void disk_free( disk_t *disk );
+
+/********** statics **********/
+static int soft_interleave16[ 16 ] =
+    { 0, 7, 0xE, 6, 0xD, 5, 0xC, 4, 0xB, 3, 0xA, 2, 9, 1, 8, 0xF };
+static int phys_interleave16[ 16 ] =
+    { 0, 0xD, 0xB, 9, 7, 5, 3, 1, 0xE, 0xC, 0xA, 8, 6, 4, 2, 0xF };
+static int soft_interleave13[ 13 ] =
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 0xA, 0xB, 0xC };
+static int phys_interleave13[ 13 ] =
+    { 0, 4, 8, 0xC, 3, 7, 0xB, 2, 6, 0xA, 1, 5, 9 };
+
+static uchar table62[ 0x40 ] = {
+    0x96, 0x97, 0x9a, 0x9b, 0x9d, 0x9e, 0x9f, 0xa6,
+    0xa7, 0xab, 0xac, 0xad, 0xae, 0xaf, 0xb2, 0xb3,
+    0xb4, 0xb5, 0xb6, 0xb7, 0xb9, 0xba, 0xbb, 0xbc,
+    0xbd, 0xbe, 0xbf, 0xcb, 0xcd, 0xce, 0xcf, 0xd3,
+    0xd6, 0xd7, 0xd9, 0xda, 0xdb, 0xdc, 0xdd, 0xde,
+    0xdf, 0xe5, 0xe6, 0xe7, 0xe9, 0xea, 0xeb, 0xec,
+    0xed, 0xee, 0xef, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6,
+    0xf7, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
+};
+static uchar table53[ 0x20 ] = {
+    0xab, 0xad, 0xae, 0xaf, 0xb5, 0xb6, 0xb7, 0xba,
+    0xbb, 0xbd, 0xbe, 0xbf, 0xd6, 0xd7, 0xda, 0xdb,
+    0xdd, 0xde, 0xdf, 0xea, 0xeb, 0xed, 0xee, 0xef,
+    0xf5, 0xf6, 0xf7, 0xfa, 0xfb, 0xfd, 0xfe, 0xff
+};
+
+//
+// Inverse tables: disk byte => 6 or 5 bit value, -1 if invalid
+//
+static const signed char untable62[ 0x100 ] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 1x
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 2x
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 3x
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 4x
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 5x
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 6x
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 7x
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 8x
+    -1, -1, -1, -1, -1, -1,  0,  1, -1, -1,  2,  3, -1,  4,  5,  6, // 9x
+    -1, -1, -1, -1, -1, -1,  7,  8, -1, -1, -1,  9, 10, 11, 12, 13, // ax
+    -1, -1, 14, 15, 16, 17, 18, 19, -1, 20, 21, 22, 23, 24, 25, 26, // bx
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 27, -1, 28, 29, 30, // cx
+    -1, -1, -1, 31, -1, -1, 32, 33, -1, 34, 35, 36, 37, 38, 39, 40, // dx
+    -1, -1, -1, -1, -1, 41, 42, 43, -1, 44, 45, 46, 47, 48, 49, 50, // ex
+    -1, -1, 51, 52, 53, 54, 55, 56, -1, 57, 58, 59, 60, 61, 62, 63  // fx
+};
+static const signed char untable53[ 0x100 ] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 1x
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 2x
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 3x
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 4x
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 5x
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 6x
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 7x
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 8x
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 9x
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  0, -1,  1,  2,  3, // ax
+    -1, -1, -1, -1, -1,  4,  5,  6, -1, -1,  7,  8, -1,  9, 10, 11, // bx
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // cx
+    -1, -1, -1, -1, -1, -1, 12, 13, -1, -1, 14, 15, -1, 16, 17, 18, // dx
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 19, 20, -1, 21, 22, 23, // ex
+    -1, -1, -1, -1, -1, 24, 25, 26, -1, -1, 27, 28, -1, 29, 30, 31  // fx
+};
+
+/********** globals **********/
+geom_t geom_16 = {
+    16, DSK_LEN, 416, 48, 342, { 0xd5, 0xaa, 0x96 },
+    soft_interleave16, phys_interleave16, nibbilize62, denibbilize62
+};
+geom_t geom_13 = {
+    13, D13_LEN, 512, 76, 410, { 0xd5, 0xaa, 0xb5 },
+    soft_interleave13, phys_interleave13, nibbilize53, denibbilize53
+};
+
+uchar nib_addr_epilog[ EPILOG_LEN ] = { 0xde, 0xaa, 0xeb };
+uchar nib_data_prolog[ PROLOG_LEN ] = { 0xd5, 0xaa, 0xad };
+uchar nib_data_epilog[ EPILOG_LEN ] = { 0xde, 0xaa, 0xeb };
+
+/************************* Disk Routines *************************/
+
+//
+// Open DSK or NIB image
+//
+disk_t *disk_open( char *path, int rw, int cache_tracks )
+{
+    int i;
+    disk_t *disk;
+    struct stat st;
+
+    if ( cache_tracks <= 0 )
+        cache_tracks = DISK_CACHE_TRACKS;
+    if ( cache_tracks > TRACKS_PER_DISK )
+        cache_tracks = TRACKS_PER_DISK;
+
+    if ( ( disk = (disk_t *) calloc( 1, sizeof( disk_t ) ) ) == NULL )
+        return NULL;
+
+    disk->rw = rw;
+    disk->volume = DEFAULT_VOLUME;
+    disk->ntracks = cache_tracks;
+
+    if ( ( disk->fd = open( path, rw ? O_RDWR : O_RDONLY ) ) == -1 ) {
+        free( disk );
+        return NULL;
+    }
+
+    if ( fstat( disk->fd, &st ) == -1 || ( st.st_size != DSK_LEN &&
+         st.st_size != D13_LEN && st.st_size != NIB_LEN ) ) {
+            disk_free( disk );
+            return NULL;
+    }
+
+    //
+    // DSK geometry follows from the image size, NIB geometry from the
+    // address prolog on track 0
+    //
+    if ( st.st_size == NIB_LEN ) {
+        uchar nib[ BYTES_PER_NIB_TRACK ];
+
+        disk->format = DISK_NIB;
+        if ( pread( disk->fd, nib, BYTES_PER_NIB_TRACK, 0 ) !=
+            BYTES_PER_NIB_TRACK ) {
+                disk_free( disk );
+                return NULL;
+        }
+        if ( ( disk->geom = nib_track_geom( nib ) ) == NULL )
+            disk->geom = &geom_16;
+        if ( !rw )
+            load_index( disk, path, &st );
+    } else {
+        disk->format = DISK_DSK;
+        disk->geom = ( st.st_size == DSK_LEN ) ? &geom_16 : &geom_13;
+    }
+
+    if ( ( disk->cache = (track_t *)
+        calloc( cache_tracks, sizeof( track_t ) ) ) == NULL ) {
+            disk_free( disk );
+            return NULL;
+    }
+    for ( i = 0; i < cache_tracks; i++ )
+        disk->cache[ i ].track = -1;
+
+    return disk;
+}
+
+//
+// Flush and close disk
+//
+int disk_close( disk_t *disk )
+{
+    int status = disk_flush( disk );
+
+    disk_free( disk );
+
+    return status;
+}
+
+//
+// Write back all dirty tracks
+//
+int disk_flush( disk_t *disk )
+{
+    int i, status = 0;
+
+    for ( i = 0; i < disk->ntracks; i++ )
+        if ( disk->cache[ i ].dirty && write_back( disk, &disk->cache[ i ] ) )
+            status = -1;
+
+    return status;
+}
+
+//
+// Return image file format
+//
+int disk_format( disk_t *disk )
+{
+    return disk->format;
+}
+
+//
+// Return disk geometry
+//
+geom_t *disk_geom( disk_t *disk )
+{
+    return disk->geom;
+}
+
+//
+// Set volume number for DSK tracks encoded from now on
+//
+void disk_set_volume( disk_t *disk, int volume )
+{
+    int i;
+    track_t *t;
+
+    disk->volume = volume;
+
+    if ( disk->format != DISK_DSK )
+        return;
+
+    for ( i = 0; i < disk->ntracks; i++ ) {
+        t = &disk->cache[ i ];
+        if ( t->track != -1 && t->volume != volume ) {
+            t->volume = volume;
+            t->nib_valid = 0;
+        }
+    }
+}
+
+//
+// Read logical sector
+//
+int disk_read_sector( disk_t *disk, int track, int sector, uchar *buf )
+{
+    track_t *t;
+
+    if ( sector < 0 || sector >= disk->geom->sectors )
+        return -1;
+    if ( ( t = get_track( disk, track ) ) == NULL )
+        return -1;
+
+    need_dsk( disk, t );
+    if ( !( t->found & 1 << sector ) )
+        return -1;
+
+    memcpy( buf, t->dsk + sector * BYTES_PER_SECTOR, BYTES_PER_SECTOR );
+
+    return 0;
+}
+
+//
+// Write logical sector
+// The track is encoded again as a whole, so all of its sectors must have
+// decoded
+//
+int disk_write_sector( disk_t *disk, int track, int sector, uchar *buf )
+{
+    track_t *t;
+
+    if ( !disk->rw || sector < 0 || sector >= disk->geom->sectors )
+        return -1;
+    if ( ( t = get_track( disk, track ) ) == NULL )
+        return -1;
+
+    need_dsk( disk, t );
+    if ( t->found != ALL_SECTORS( disk->geom ) )
+        return -1;
+
+    memcpy( t->dsk + sector * BYTES_PER_SECTOR, buf, BYTES_PER_SECTOR );
+    t->nib_valid = 0;
+    t->dirty = 1;
+
+    return 0;
+}
+
+//
+// Read NIB track
+//
+int disk_read_nib_track( disk_t *disk, int track, uchar *buf )
+{
+    track_t *t;
+
+    if ( ( t = get_track( disk, track ) ) == NULL )
+        return -1;
+
+    need_nib( disk, t );
+    memcpy( buf, t->nib, BYTES_PER_NIB_TRACK );
+
+    return 0;
+}
+
+//
+// Write NIB track
+// A DSK image can only take tracks that decode into all good sectors
+//
+int disk_write_nib_track( disk_t *disk, int track, uchar *buf )
+{
+    track_t *t;
+    uchar dsk[ BYTES_PER_TRACK ];
+    int volume;
+
+    if ( !disk->rw || ( t = get_track( disk, track ) ) == NULL )
+        return -1;
+
+    if ( disk->format == DISK_DSK ) {
+        if ( nib_decode_track( disk->geom, dsk, buf, track, &volume ) )
+            return -1;
+        memcpy( t->dsk, dsk, BYTES_PER_TRACK );
+        t->found = ALL_SECTORS( disk->geom );
+    } else
+        t->dsk_valid = 0;
+
+    memcpy( t->nib, buf, BYTES_PER_NIB_TRACK );
+    t->nib_valid = 1;
+    t->dirty = 1;
+
+    return 0;
+}
+
+//
+// Return cache slot holding track, reading it from the image if needed
+//
+static track_t *get_track( disk_t *disk, int track )
+{
+    int i;
+    track_t *t, *victim = NULL;
+    off_t offset;
+    ssize_t len;
+    uchar *buf;
+
+    if ( track < 0 || track >= TRACKS_PER_DISK )
+        return NULL;
+
+    for ( i = 0; i < disk->ntracks; i++ ) {
+        t = &disk->cache[ i ];
+        if ( t->track == track ) {
+            t->used = ++disk->clock;
+            return t;
+        }
+        if ( victim == NULL || t->used < victim->used )
+            victim = t;
+    }
+
+    //
+    // Evict least recently used track
+    //
+    t = victim;
+    if ( t->dirty && write_back( disk, t ) )
+        return NULL;
+
+    if ( disk->format == DISK_DSK ) {
+        buf = t->dsk;
+        len = disk->geom->sectors * BYTES_PER_SECTOR;
+    } else {
+        buf = t->nib;
+        len = BYTES_PER_NIB_TRACK;
+    }
+    offset = (off_t) track * len;
+
+    t->track = -1;
+    t->used = 0;
+    if ( pread( disk->fd, buf, len, offset ) != len )
+        return NULL;
+
+    t->track = track;
+    t->volume = disk->volume;
+    t->dsk_valid = ( disk->format == DISK_DSK );
+    t->nib_valid = ( disk->format == DISK_NIB );
+    t->found = t->dsk_valid ? ALL_SECTORS( disk->geom ) : 0;
+    t->dirty = 0;
+    t->used = ++disk->clock;
+
+    return t;
+}
+
+//
+// Make sure the DSK form of a cached track is valid
+// Sectors that do not decode are left out of t->found
+//
+static void need_dsk( disk_t *disk, track_t *t )
+{
+    if ( !t->dsk_valid ) {
+        if ( disk->idx == NULL || nib_decode_indexed( disk->geom, t->dsk,
+            t->nib, t->track, &t->volume, disk->idx, disk->nidx, &t->found,
+            NULL ) )
+                t->found = nib_decode_sectors( disk->geom, t->dsk, t->nib,
+                    t->track, &t->volume, NULL );
+        t->dsk_valid = 1;
+    }
+}
+
+//
+// Load sidecar index of a NIB opened read-only, if there is a valid one
+//
+static void load_index( disk_t *disk, char *path, struct stat *st )
+{
+    char idx_path[ PATH_MAX ];
+    nibidx_header_t h;
+
+    nibidx_path( idx_path, sizeof( idx_path ), path );
+    if ( ( disk->idx = nibidx_read( idx_path, &h, st ) ) == NULL )
+        return;
+
+    if ( h.sectors != (uint32_t) disk->geom->sectors ) {
+        free( disk->idx );
+        disk->idx = NULL;
+        return;
+    }
+    disk->nidx = h.nentries;
+}
+
+//
+// Return pointer to len bytes at start of a NIB track, copying them into
+// buf if they wrap around its end
+//
+static uchar *track_field( uchar *nib, long start, int len, uchar *buf )
+{
+    start = ( start + BYTES_PER_NIB_TRACK ) % BYTES_PER_NIB_TRACK;
+    if ( start + len <= BYTES_PER_NIB_TRACK )
+        return nib + start;
+
+    memcpy( buf, nib + start, BYTES_PER_NIB_TRACK - start );
+    memcpy( buf + BYTES_PER_NIB_TRACK - start, nib,
+        len - ( BYTES_PER_NIB_TRACK - start ) );
+
+    return buf;
+}
+
+//
+// Make sure the NIB form of a cached track is valid
+//
+static void need_nib( disk_t *disk, track_t *t )
+{
+    if ( !t->nib_valid ) {
+        nib_encode_track( disk->geom, t->nib, t->dsk, t->volume, t->track );
+        t->nib_valid = 1;
+    }
+}
+
+//
+// Write cached track to the image file in its own format
+//
+static int write_back( disk_t *disk, track_t *t )
+{
+    uchar *buf;
+    ssize_t len;
+
+    if ( disk->format == DISK_DSK ) {
+        buf = t->dsk;
+        len = disk->geom->sectors * BYTES_PER_SECTOR;
+    } else {
+        need_nib( disk, t );
+        buf = t->nib;
+        len = BYTES_PER_NIB_TRACK;
+    }
+
+    if ( pwrite( disk->fd, buf, len, (off_t) t->track * len ) != len )
+        return -1;
+
+    t->dirty = 0;
+
+    return 0;
+}
+
+//
+// Close image file and free disk
+//
+static void disk_free( disk_t *disk )
+{
+    close( disk->fd );
+    free( disk->cache );
+    free( disk->idx );
+    free( disk );
+}
+
+/************************* Track Codec *************************/
+
+//
+// Encode DSK track into NIB track with the dsk2nib layout
+// Sectors in dsk are in DSK image order
+//
+void nib_encode_track( geom_t *geom, uchar *nib, uchar *dsk, int volume,
+    int track )
+{
+    int sec, gap1_len = geom->gap1_len;
+    uchar *slot;
+    addr_t *addr;
+
+    for ( sec = 0; sec < geom->sectors; sec++ ) {
+        slot = nib + geom->phys_interleave[ sec ] * geom->nib_sector_len;
+        addr = (addr_t *) ( slot + gap1_len );
+
+        memset( slot, GAP_BYTE, gap1_len );
+
+        memcpy( addr->prolog, geom->addr_prolog, PROLOG_LEN );
+        nib_odd_even_encode( addr->volume, volume );
+        nib_odd_even_encode( addr->track, track );
+        nib_odd_even_encode( addr->sector, sec );
+        nib_odd_even_encode( addr->checksum, volume ^ track ^ sec );
+        memcpy( addr->epilog, nib_addr_epilog, EPILOG_LEN );
+
+        slot = (uchar *) ( addr + 1 );
+        memset( slot, GAP_BYTE, GAP2_LEN );
+        slot += GAP2_LEN;
+
+        memcpy( slot, nib_data_prolog, PROLOG_LEN );
+        slot += PROLOG_LEN;
+        geom->encode( dsk + geom->soft_interleave[ sec ] * BYTES_PER_SECTOR,
+            slot );
+        slot += geom->data_len + 1;
+        memcpy( slot, nib_data_epilog, EPILOG_LEN );
+    }
+}
+
+//
+// Decode NIB track into DSK track
+// Returns -1 unless all sectors were found with good checksums
+//
+int nib_decode_track( geom_t *geom, uchar *dsk, uchar *nib, int track,
+    int *volume )
+{
+    return ( nib_decode_sectors( geom, dsk, nib, track, volume, NULL ) ==
+        ALL_SECTORS( geom ) ) ? 0 : -1;
+}
+
+//
+// Decode NIB track into DSK track
+// Returns bit mask of the DSK sectors found with good checksums
+//
+unsigned nib_decode_sectors( geom_t *geom, uchar *dsk, uchar *nib,
+    int track, int *volume, nib_stats_t *stats )
+{
+    long i, next;
+    unsigned found = 0;
+    nib_field_t f;
+    uchar buf[ 2 * BYTES_PER_NIB_TRACK ];
+    uchar sec_buf[ BYTES_PER_SECTOR ];
+
+    if ( decode_fixed( geom, dsk, nib, track, volume, stats ) == 0 )
+        return ALL_SECTORS( geom );
+
+    //
+    // Scan a doubled copy of the track so sectors may wrap around its end
+    //
+    memcpy( buf, nib, BYTES_PER_NIB_TRACK );
+    memcpy( buf + BYTES_PER_NIB_TRACK, nib, BYTES_PER_NIB_TRACK );
+
+    for ( i = 0; i < BYTES_PER_NIB_TRACK; i++ ) {
+        if ( ( next = decode_field( geom, buf, i, sizeof( buf ), track, &f,
+            sec_buf, stats ) ) == -1 )
+                continue;
+
+        f.addr %= BYTES_PER_NIB_TRACK;
+        f.data %= BYTES_PER_NIB_TRACK;
+        store_field( geom, dsk, &f, sec_buf, &found, volume, stats );
+        i = next;
+    }
+
+    return found;
+}
+
+//
+// Decode NIB image of any length into a DSK image by a linear scan
+// Sectors are filed by the track in their address field
+//
+void nib_decode_image( geom_t *geom, uchar *dsk, uchar *nib, long len,
+    unsigned *found, nib_stats_t *stats )
+{
+    long i, next;
+    int volume;
+    nib_field_t f;
+    uchar sec_buf[ BYTES_PER_SECTOR ];
+
+    memset( found, 0, TRACKS_PER_DISK * sizeof( unsigned ) );
+
+    for ( i = 0; i < len; i++ ) {
+        if ( ( next = decode_field( geom, nib, i, len, -1, &f, sec_buf,
+            stats ) ) == -1 )
+                continue;
+
+        store_field( geom, dsk + f.track * geom->sectors * BYTES_PER_SECTOR,
+            &f, sec_buf, &found[ f.track ], &volume, stats );
+        i = next;
+    }
+}
+
+//
+// Decode NIB track from the fields its sidecar index entries list
+// Returns -1, having decoded nothing, if any field is no longer where
+// the index says
+//
+// Entry offsets are from the start of the NIB file, so only standard
+// length NIBs are indexed.
+//
+int nib_decode_indexed( geom_t *geom, uchar *dsk, uchar *nib, int track,
+    int *volume, nibidx_entry_t *idx, uint32_t nidx, unsigned *found,
+    nib_stats_t *stats )
+{
+    long base = (long) track * BYTES_PER_NIB_TRACK;
+    uint32_t i;
+    nibidx_entry_t *e;
+    nib_field_t f;
+    addr_t *addr;
+    uchar field[ MAX_DATA_LEN + 1 ];
+    uchar sec_buf[ BYTES_PER_SECTOR ];
+
+    //
+    // Check the marks and address of every field of the track first
+    //
+    for ( i = 0, e = idx; i < nidx; i++, e++ ) {
+        if ( e->track != track )
+            continue;
+        if ( e->addr < base || e->addr >= base + BYTES_PER_NIB_TRACK ||
+             e->data < base || e->data >= base + BYTES_PER_NIB_TRACK ||
+             e->sector >= geom->sectors )
+                return -1;
+
+        addr = (addr_t *) track_field( nib, e->addr - base,
+            sizeof( addr_t ), field );
+        if ( memcmp( addr->prolog, geom->addr_prolog, PROLOG_LEN ) ||
+             memcmp( addr->epilog, nib_addr_epilog, 2 ) ||
+             nib_odd_even_decode( addr->volume[ 0 ], addr->volume[ 1 ] ) !=
+                e->volume ||
+             nib_odd_even_decode( addr->track[ 0 ], addr->track[ 1 ] ) !=
+                e->track ||
+             nib_odd_even_decode( addr->sector[ 0 ], addr->sector[ 1 ] ) !=
+                e->sector ||
+             nib_odd_even_decode( addr->checksum[ 0 ], addr->checksum[ 1 ] ) !=
+                ( e->volume ^ e->track ^ e->sector ) )
+                    return -1;
+
+        if ( memcmp( track_field( nib, e->data - base - PROLOG_LEN,
+            PROLOG_LEN, field ), nib_data_prolog, PROLOG_LEN ) )
+                return -1;
+    }
+
+    //
+    // Replay them in scan order, so sectors are found as a scan finds them
+    //
+    *found = 0;
+    for ( i = 0, e = idx; i < nidx; i++, e++ ) {
+        if ( e->track != track )
+            continue;
+
+        f.addr = e->addr - base;
+        f.data = e->data - base;
+        f.volume = e->volume;
+        f.track = e->track;
+        f.sector = e->sector;
+        f.status = geom->decode( track_field( nib, f.data,
+            geom->data_len + 1, field ), sec_buf );
+        count_field( &f, stats );
+        store_field( geom, dsk, &f, sec_buf, found, volume, stats );
+    }
+
+    return 0;
+}
+
+//
+// Return geometry of a NIB track: the one whose address prolog comes
+// first, or NULL if there is none
+//
+geom_t *nib_track_geom( uchar *nib )
+{
+    return nib_find_geom( nib, BYTES_PER_NIB_TRACK );
+}
+
+//
+// Return geometry of the first address prolog in len NIB bytes, or NULL
+//
+geom_t *nib_find_geom( uchar *nib, long len )
+{
+    long i;
+
+    for ( i = 0; i + PROLOG_LEN <= len; i++ ) {
+        if ( memcmp( nib + i, geom_16.addr_prolog, PROLOG_LEN ) == 0 )
+            return &geom_16;
+        if ( memcmp( nib + i, geom_13.addr_prolog, PROLOG_LEN ) == 0 )
+            return &geom_13;
+    }
+
+    return NULL;
+}
+
+//
+// Decode NIB track by direct indexing if it has the dsk2nib layout
+// Returns -1 if it does not
+//
+// Fields are only reported to stats once the whole track has decoded,
+// as otherwise the scan decodes it again.
+//
+static int decode_fixed( geom_t *geom, uchar *dsk, uchar *nib, int track,
+    int *volume, nib_stats_t *stats )
+{
+    int sec, v;
+    uchar *data;
+    addr_t *addr;
+    nib_field_t f[ SECTORS_PER_TRACK ];
+
+    for ( sec = 0; sec < geom->sectors; sec++ ) {
+        addr = (addr_t *) ( nib + geom->gap1_len +
+            geom->phys_interleave[ sec ] * geom->nib_sector_len );
+        data = (uchar *) ( addr + 1 ) + GAP2_LEN;
+
+        if ( memcmp( addr->prolog, geom->addr_prolog, PROLOG_LEN ) ||
+             memcmp( addr->epilog, nib_addr_epilog, EPILOG_LEN ) ||
+             memcmp( data, nib_data_prolog, PROLOG_LEN ) ||
+             memcmp( data + PROLOG_LEN + geom->data_len + 1, nib_data_epilog,
+                EPILOG_LEN ) )
+                    return -1;
+
+        //
+        // Same address field rules as the scan (see decode_field())
+        //
+        v = nib_odd_even_decode( addr->volume[ 0 ], addr->volume[ 1 ] );
+        if ( nib_odd_even_decode( addr->track[ 0 ], addr->track[ 1 ] ) !=
+                track ||
+             nib_odd_even_decode( addr->sector[ 0 ], addr->sector[ 1 ] ) !=
+                sec ||
+             nib_odd_even_decode( addr->checksum[ 0 ], addr->checksum[ 1 ] ) !=
+                ( v ^ track ^ sec ) )
+                    return -1;
+
+        if ( geom->decode( data + PROLOG_LEN,
+            dsk + geom->soft_interleave[ sec ] * BYTES_PER_SECTOR ) )
+                return -1;
+
+        *volume = v;
+
+        f[ sec ].addr = (uchar *) addr - nib;
+        f[ sec ].data = data + PROLOG_LEN - nib;
+        f[ sec ].volume = v;
+        f[ sec ].track = track;
+        f[ sec ].sector = sec;
+        f[ sec ].status = 0;
+    }
+
+    if ( stats && stats->found )
+        for ( sec = 0; sec < geom->sectors; sec++ )
+            stats->found( &f[ sec ], stats->arg );
+
+    return 0;
+}
+
+//
+// Decode the sector copy whose address prolog is at buf[ i ] into sec_buf
+// Returns the offset of its data checksum, or -1 if there is none
+//
+// The address field needs its first two epilog bytes, a good checksum,
+// a sector in range and the track being decoded (any track if track is
+// -1), and the data prolog must follow within DATA_SEARCH_LEN bytes. A
+// wrong data epilog is counted but does not reject the copy.
+//
+static long decode_field( geom_t *geom, uchar *buf, long i, long len,
+    int track, nib_field_t *f, uchar *sec_buf, nib_stats_t *stats )
+{
+    long j, limit;
+    int c;
+    addr_t *addr = (addr_t *) ( buf + i );
+
+    if ( i + (long) sizeof( addr_t ) > len ||
+         memcmp( addr->prolog, geom->addr_prolog, PROLOG_LEN ) )
+            return -1;
+
+    if ( memcmp( addr->epilog, nib_addr_epilog, 2 ) ) {
+        if ( stats )
+            ++stats->bad_epilog;
+        return -1;
+    }
+
+    f->volume = nib_odd_even_decode( addr->volume[ 0 ], addr->volume[ 1 ] );
+    f->track = nib_odd_even_decode( addr->track[ 0 ], addr->track[ 1 ] );
+    f->sector = nib_odd_even_decode( addr->sector[ 0 ], addr->sector[ 1 ] );
+    c = nib_odd_even_decode( addr->checksum[ 0 ], addr->checksum[ 1 ] );
+    if ( ( f->volume ^ f->track ^ f->sector ) != c ||
+         ( track == -1 ? f->track >= TRACKS_PER_DISK : f->track != track ) ||
+         f->sector >= geom->sectors ) {
+            if ( stats )
+                ++stats->bad_addr;
+            return -1;
+    }
+
+    limit = i + sizeof( addr_t ) + DATA_SEARCH_LEN;
+    for ( j = i + sizeof( addr_t ); j < limit && j + PROLOG_LEN <= len; j++ )
+        if ( memcmp( buf + j, nib_data_prolog, PROLOG_LEN ) == 0 )
+            break;
+    if ( j == limit || j + PROLOG_LEN > len )
+        return -1;
+
+    j += PROLOG_LEN;
+    if ( j + geom->data_len + 1 > len )
+        return -1;
+
+    f->addr = i;
+    f->data = j;
+    f->status = geom->decode( buf + j, sec_buf );
+    count_field( f, stats );
+
+    if ( stats && ( j + geom->data_len + 1 + EPILOG_LEN > len ||
+         memcmp( buf + j + geom->data_len + 1, nib_data_epilog,
+            EPILOG_LEN ) ) )
+                ++stats->bad_epilog;
+
+    return j + geom->data_len;
+}
+
+//
+// Store a decoded sector copy and report it
+//
+// A good copy replaces any earlier one. A copy with a bad data checksum
+// is kept only while there is no good one, and is not marked found.
+//
+static void store_field( geom_t *geom, uchar *dsk, nib_field_t *f,
+    uchar *sec_buf, unsigned *found, int *volume, nib_stats_t *stats )
+{
+    int sec = geom->soft_interleave[ f->sector ];
+
+    if ( f->status == 0 ||
+         ( f->status == NIB_BAD_CHECKSUM && !( *found & 1u << sec ) ) )
+            memcpy( dsk + sec * BYTES_PER_SECTOR, sec_buf, BYTES_PER_SECTOR );
+
+    if ( f->status == 0 ) {
+        *found |= 1u << sec;
+        *volume = f->volume;
+    }
+
+    if ( stats && stats->found )
+        stats->found( f, stats->arg );
+}
+
+//
+// Count a bad data field
+//
+static void count_field( nib_field_t *f, nib_stats_t *stats )
+{
+    if ( stats == NULL )
+        return;
+
+    if ( f->status == NIB_BAD_BYTE )
+        ++stats->bad_bytes;
+    else if ( f->status == NIB_BAD_CHECKSUM )
+        ++stats->bad_data;
+}
+
+//
+// Encode 1 byte into two "4 and 4" bytes
+//
+void nib_odd_even_encode( uchar a[], int i )
+{
+    a[ 0 ] = ( ( i >> 1 ) & 0x55 ) | 0xaa;
+    a[ 1 ] = ( i & 0x55 ) | 0xaa;
+}
+
+//
+// Decode 2 "4 and 4" bytes into 1 byte
+//
+uchar nib_odd_even_decode( uchar byte1, uchar byte2 )
+{
+    return ( ( byte1 << 1 ) & 0xaa ) | ( byte2 & 0x55 );
+}
+
+//
+// Convert 256 data bytes into 342 6+2 encoded bytes and a checksum
+//
+static void nibbilize62( uchar *src, uchar *dest )
+{
+    int i;
+    uchar primary_buf[ PRIMARY_BUF_LEN ];
+    uchar secondary_buf[ SECONDARY_BUF_LEN ];
+    uchar pair;
+
+    memset( secondary_buf, 0, SECONDARY_BUF_LEN );
+
+    for ( i = 0; i < PRIMARY_BUF_LEN; i++ ) {
+        primary_buf[ i ] = src[ i ] >> 2;
+        pair = ((src[i]&2)>>1) | ((src[i]&1)<<1);       // swap the low bits
+        secondary_buf[ i % SECONDARY_BUF_LEN ] |=
+            pair << ( ( i / SECONDARY_BUF_LEN ) * 2 );
+    }
+
+    *dest++ = table62[ secondary_buf[ 0 ] & 0x3f ];
+    for ( i = 1; i < SECONDARY_BUF_LEN; i++ )
+        *dest++ = table62[ ( secondary_buf[ i ] ^ secondary_buf[ i-1 ] ) & 0x3f ];
+
+    *dest++ = table62[ ( primary_buf[ 0 ] ^
+        secondary_buf[ SECONDARY_BUF_LEN-1 ] ) & 0x3f ];
+    for ( i = 1; i < PRIMARY_BUF_LEN; i++ )
+        *dest++ = table62[ ( primary_buf[ i ] ^ primary_buf[ i-1 ] ) & 0x3f ];
+
+    *dest = table62[ primary_buf[ PRIMARY_BUF_LEN-1 ] & 0x3f ];
+}
+
+//
+// Convert 343 6+2 encoded bytes into 256 data bytes
+// Returns NIB_BAD_BYTE on an invalid disk byte, NIB_BAD_CHECKSUM on a
+// checksum mismatch (dest is written all the same)
+//
+static int denibbilize62( uchar *src, uchar *dest )
+{
+    int i, x;
+    uchar checksum = 0, bits;
+    uchar primary_buf[ PRIMARY_BUF_LEN ];
+    uchar secondary_buf[ SECONDARY_BUF_LEN ];
+
+    for ( i = 0; i < SECONDARY_BUF_LEN; i++ ) {
+        if ( ( x = untable62[ *src++ ] ) < 0 )
+            return NIB_BAD_BYTE;
+        secondary_buf[ i ] = checksum ^= x;
+    }
+
+    for ( i = 0; i < PRIMARY_BUF_LEN; i++ ) {
+        if ( ( x = untable62[ *src++ ] ) < 0 )
+            return NIB_BAD_BYTE;
+        primary_buf[ i ] = checksum ^= x;
+    }
+
+    if ( ( x = untable62[ *src ] ) < 0 )
+        return NIB_BAD_BYTE;
+    checksum ^= x;
+
+    for ( i = 0; i < PRIMARY_BUF_LEN; i++ ) {
+        bits = secondary_buf[ i % SECONDARY_BUF_LEN ] >>
+            ( ( i / SECONDARY_BUF_LEN ) * 2 );
+        dest[ i ] = ( primary_buf[ i ] << 2 ) |
+            ( ( bits & 1 ) << 1 ) | ( ( bits & 2 ) >> 1 );
+    }
+
+    return checksum ? NIB_BAD_CHECKSUM : 0;
+}
+
+//
+// Convert 256 data bytes into 410 5+3 encoded bytes and a checksum
+//
+// Bytes are taken 5 at a time; their top 5 bits go to five 51 byte
+// sections of top_buf, their low 3 bits are packed into three sections
+// of threes_buf. The 256th byte fills the last entry of each buffer.
+// threes_buf is written first, last entry first.
+//
+static void nibbilize53( uchar *src, uchar *dest )
+{
+    int i, chunk;
+    uchar top_buf[ TOP_BUF_LEN ];
+    uchar threes_buf[ THREES_BUF_LEN ];
+    uchar last = 0;
+    uchar b1, b2, b3, b4, b5;
+
+    for ( chunk = CHUNK_LEN - 1; chunk >= 0; chunk-- ) {
+        b1 = *src++;
+        b2 = *src++;
+        b3 = *src++;
+        b4 = *src++;
+        b5 = *src++;
+
+        top_buf[ chunk ] = b1 >> 3;
+        top_buf[ chunk + CHUNK_LEN ] = b2 >> 3;
+        top_buf[ chunk + CHUNK_LEN*2 ] = b3 >> 3;
+        top_buf[ chunk + CHUNK_LEN*3 ] = b4 >> 3;
+        top_buf[ chunk + CHUNK_LEN*4 ] = b5 >> 3;
+
+        threes_buf[ chunk ] =
+            ( b1 & 7 ) << 2 | ( b4 & 4 ) >> 1 | ( b5 & 4 ) >> 2;
+        threes_buf[ chunk + CHUNK_LEN ] =
+            ( b2 & 7 ) << 2 | ( b4 & 2 ) | ( b5 & 2 ) >> 1;
+        threes_buf[ chunk + CHUNK_LEN*2 ] =
+            ( b3 & 7 ) << 2 | ( b4 & 1 ) << 1 | ( b5 & 1 );
+    }
+
+    top_buf[ TOP_BUF_LEN-1 ] = *src >> 3;
+    threes_buf[ THREES_BUF_LEN-1 ] = *src & 7;
+
+    for ( i = THREES_BUF_LEN - 1; i >= 0; i-- ) {
+        *dest++ = table53[ threes_buf[ i ] ^ last ];
+        last = threes_buf[ i ];
+    }
+
+    for ( i = 0; i < TOP_BUF_LEN; i++ ) {
+        *dest++ = table53[ top_buf[ i ] ^ last ];
+        last = top_buf[ i ];
+    }
+
+    *dest = table53[ last ];
+}
+
+//
+// Convert 411 5+3 encoded bytes into 256 data bytes
+// Returns NIB_BAD_BYTE on an invalid disk byte, NIB_BAD_CHECKSUM on a
+// checksum mismatch (dest is written all the same)
+//
+static int denibbilize53( uchar *src, uchar *dest )
+{
+    int i, x, chunk;
+    uchar checksum = 0;
+    uchar top_buf[ TOP_BUF_LEN ];
+    uchar threes_buf[ THREES_BUF_LEN ];
+    uchar t1, t2, t3;
+
+    for ( i = THREES_BUF_LEN - 1; i >= 0; i-- ) {
+        if ( ( x = untable53[ *src++ ] ) < 0 )
+            return NIB_BAD_BYTE;
+        threes_buf[ i ] = checksum ^= x;
+    }
+
+    for ( i = 0; i < TOP_BUF_LEN; i++ ) {
+        if ( ( x = untable53[ *src++ ] ) < 0 )
+            return NIB_BAD_BYTE;
+        top_buf[ i ] = checksum ^= x;
+    }
+
+    if ( ( x = untable53[ *src ] ) < 0 )
+        return NIB_BAD_BYTE;
+    checksum ^= x;
+
+    for ( chunk = CHUNK_LEN - 1; chunk >= 0; chunk-- ) {
+        t1 = threes_buf[ chunk ];
+        t2 = threes_buf[ chunk + CHUNK_LEN ];
+        t3 = threes_buf[ chunk + CHUNK_LEN*2 ];
+
+        *dest++ = top_buf[ chunk ] << 3 | t1 >> 2;
+        *dest++ = top_buf[ chunk + CHUNK_LEN ] << 3 | t2 >> 2;
+        *dest++ = top_buf[ chunk + CHUNK_LEN*2 ] << 3 | t3 >> 2;
+        *dest++ = top_buf[ chunk + CHUNK_LEN*3 ] << 3 |
+            ( t1 & 2 ) << 1 | ( t2 & 2 ) | ( t3 & 2 ) >> 1;
+        *dest++ = top_buf[ chunk + CHUNK_LEN*4 ] << 3 |
+            ( t1 & 1 ) << 2 | ( t2 & 1 ) << 1 | ( t3 & 1 );
+    }
+
+    *dest = top_buf[ TOP_BUF_LEN-1 ] << 3 | threes_buf[ THREES_BUF_LEN-1 ];
+
+    return checksum ? NIB_BAD_CHECKSUM : 0;
+}
@@ -0,0 +1,98 @@
+//
+// disk.h - random access to Apple II DSK and NIB image files
+// Copyright (C) 1996, 2017 slotek@nym.hush.com
+//
+#ifndef DISK_H
+#define DISK_H
+
+/********** symbolic constants **********/
+#define DISK_TRACKS         35
+#define DISK_SECTOR_LEN     256
+#define DISK_DSK_LEN        143360L
+#define DISK_D13_LEN        116480L     // 13-sector DOS 3.2 image
+#define DISK_NIB_TRACK_LEN  6656
+#define DISK_NIB_LEN        232960L
+
+#define DISK_DEFAULT_VOLUME 254
+
+#define DISK_DSK            0       // image file formats
+#define DISK_NIB            1
+
+#define DISK_CACHE_TRACKS   4       // default number of cached tracks
+
+/********** typedefs **********/
+typedef struct disk disk_t;
+
+//
+// Disk geometry: NIB sector layout and sector data codec
+//
+typedef struct {
+    int sectors;                    // sectors per track
+    long dsk_len;                   // DSK image length
+    int nib_sector_len;             // bytes per sector in a NIB track
+    int gap1_len;                   // gap before the addr field
+    int data_len;                   // encoded data bytes, excl. checksum
+    unsigned char addr_prolog[ 3 ];
+    int *soft_interleave;           // addr sector => DSK image sector
+    int *phys_interleave;           // addr sector => NIB track slot
+    void (*encode)( unsigned char *src, unsigned char *dest );
+    int (*decode)( unsigned char *src, unsigned char *dest );
+} geom_t;
+
+/********** globals **********/
+extern geom_t geom_16;              // DOS 3.3 16 sector, 6 and 2
+extern geom_t geom_13;              // DOS 3.2 13 sector, 5 and 3
+
+/********** prototypes **********/
+//
+// Open a DSK, D13 or NIB image (told apart by file size) for reading, or for
+// reading and writing if rw is non-zero. Tracks are converted only when
+// first accessed and at most cache_tracks of them are kept in memory
+// (0 selects DISK_CACHE_TRACKS). Returns NULL on failure.
+//
+disk_t *disk_open( char *path, int rw, int cache_tracks );
+
+//
+// Write back dirty tracks, close the image file and free the disk.
+// Returns -1 if any write back failed.
+//
+int disk_close( disk_t *disk );
+
+//
+// Write back dirty tracks. Returns -1 on failure.
+//
+int disk_flush( disk_t *disk );
+
+//
+// Return image file format (DISK_DSK or DISK_NIB) and geometry. NIB
+// geometry is taken from the first address prolog on track 0.
+//
+int disk_format( disk_t *disk );
+geom_t *disk_geom( disk_t *disk );
+
+//
+// Set the volume number used when encoding NIB tracks. NIB images start
+// out with the volume found on the first decoded track, DSK images with
+// DISK_DEFAULT_VOLUME.
+//
+void disk_set_volume( disk_t *disk, int volume );
+
+//
+// Read or write one 256 byte sector in DSK image order.
+// Return -1 on failure (bad track/sector, I/O error, undecodable sector,
+// write to a read-only disk, or write to a NIB track where not every
+// sector decodes).
+//
+int disk_read_sector( disk_t *disk, int track, int sector,
+    unsigned char *buf );
+int disk_write_sector( disk_t *disk, int track, int sector,
+    unsigned char *buf );
+
+//
+// Read or write one DISK_NIB_TRACK_LEN byte NIB track.
+// Return -1 on failure.
+//
+int disk_read_nib_track( disk_t *disk, int track, unsigned char *buf );
+int disk_write_nib_track( disk_t *disk, int track, unsigned char *buf );
+
+#endif
@@ -0,0 +1,172 @@
+//
+// dskcmp.c - compare Apple II DSK and NIB images sector by sector
+// Copyright (C) 1996, 2017 slotek@nym.hush.com
+//
+// Both images are opened with the disk routines, so a NIB track is only
+// decoded when the comparison reaches it. Sectors are compared in DSK
+// image (DOS) order, and by default the first difference ends the run.
+// With --all an undecodable sector is reported and the run goes on.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "codec.h"
+
+/********** symbolic constants **********/
+#define VERSION_MAJOR       1
+#define VERSION_MINOR       0
+
+#define EXIT_SAME           0       // exit status, as for cmp(1)
+#define EXIT_DIFFER         1
+#define EXIT_TROUBLE        2
+
+/********** prototypes **********/
+disk_t *open_image( char *path );
+int read_sector( disk_t *disk, char *path, int trk, int sector,
+    uchar *buf, int all );
+
+void usage( char *path );
+void fatal( char *format, ... );
+
+int main( int argc, char **argv )
+{
+    int trk, sector, bad, all = 0, ndiff = 0, nbad = 0;
+    disk_t *disk1, *disk2;
+    geom_t *geom;
+    uchar buf1[ BYTES_PER_SECTOR ], buf2[ BYTES_PER_SECTOR ];
+
+    printf( "Apple II DSK/NIB Image Compare Version %d.%d\n\n",
+        VERSION_MAJOR, VERSION_MINOR );
+
+    //
+    // Check args
+    //
+    if ( argc == 4 && strcmp( argv[ 1 ], "--all" ) == 0 ) {
+        all = 1;
+        --argc;
+        ++argv;
+    }
+    if ( argc != 3 )
+        usage( argv[ 0 ] );
+
+    disk1 = open_image( argv[ 1 ] );
+    disk2 = open_image( argv[ 2 ] );
+
+    //
+    // 13 and 16 sector disks never hold the same data
+    //
+    if ( ( geom = disk_geom( disk1 ) ) != disk_geom( disk2 ) ) {
+        printf( "%s %s differ: %d and %d sectors per track\n", argv[ 1 ],
+            argv[ 2 ], geom->sectors, disk_geom( disk2 )->sectors );
+        exit( EXIT_DIFFER );
+    }
+
+    //
+    // Compare sectors in DOS order
+    //
+    for ( trk = 0; trk < TRACKS_PER_DISK; trk++ ) {
+        for ( sector = 0; sector < geom->sectors; sector++ ) {
+            bad = read_sector( disk1, argv[ 1 ], trk, sector, buf1, all );
+            bad |= read_sector( disk2, argv[ 2 ], trk, sector, buf2, all );
+            if ( bad ) {
+                ++nbad;
+                continue;
+            }
+
+            if ( memcmp( buf1, buf2, BYTES_PER_SECTOR ) == 0 )
+                continue;
+
+            printf( "%s %s differ: [Track:%02d] [Sector:%02d]\n", argv[ 1 ],
+                argv[ 2 ], trk, sector );
+            ++ndiff;
+            if ( !all )
+                exit( EXIT_DIFFER );
+        }
+    }
+
+    if ( ndiff || nbad ) {
+        printf( "\n%d of %d sectors differ\n", ndiff,
+            TRACKS_PER_DISK * geom->sectors );
+        if ( nbad )
+            printf( "%d sectors could not be compared\n", nbad );
+    } else
+        printf( "%s %s hold the same sectors\n", argv[ 1 ], argv[ 2 ] );
+
+    disk_close( disk1 );
+    disk_close( disk2 );
+
+    if ( nbad )
+        return EXIT_TROUBLE;
+
+    return ndiff ? EXIT_DIFFER : EXIT_SAME;
+}
+
+//
+// Open image read-only, keeping one track of it in memory
+//
+disk_t *open_image( char *path )
+{
+    disk_t *disk;
+
+    if ( ( disk = disk_open( path, 0, 1 ) ) == NULL )
+        fatal( "cannot open %s (not a DSK, D13 or NIB image?)", path );
+
+    return disk;
+}
+
+//
+// Read sector, returning -1 if it cannot be decoded
+// Without --all that ends the run at once
+//
+int read_sector( disk_t *disk, char *path, int trk, int sector,
+    uchar *buf, int all )
+{
+    if ( disk_read_sector( disk, trk, sector, buf ) == 0 )
+        return 0;
+
+    if ( !all )
+        fatal( "%s: cannot decode [Track:%02d] [Sector:%02d]", path, trk,
+            sector );
+
+    printf( "%s: cannot decode [Track:%02d] [Sector:%02d]\n", path, trk,
+        sector );
+
+    return -1;
+}
+
+/************************* Utility Routines *************************/
+
+//
+// Usage info
+//
+void usage( char *path )
+{
+    printf( "Usage: %s [--all] <image1> <image2>\n", path );
+    printf( "Where: images are DSK, D13 or NIB files in any combination\n" );
+    printf( "       --all lists every differing sector instead of the first\n" );
+    printf( "Exit:  0 if the images hold the same sectors, 1 if they differ,\n" );
+    printf( "       2 on trouble (unreadable file or undecodable sector;\n" );
+    printf( "       with --all, after comparing the rest)\n" );
+
+    exit( EXIT_TROUBLE );
+}
+
+//
+// Fatal
+//
+void fatal( char *format, ... )
+{
+    va_list argp;
+
+    printf( "\nFatal: " );
+
+    va_start( argp, format );
+    vprintf( format, argp );
+    va_end( argp );
+
+    printf( "\n" );
+
+    exit( EXIT_TROUBLE );
+}
@@ -0,0 +1,332 @@
+//
+// dskpack.c - pack Apple II DSK and NIB image files into a bundle
+// Copyright (C) 1996, 2017 slotek@nym.hush.com
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "atomic.h"
+#include "bundle.h"
+#include "codec.h"
+
+/********** symbolic constants **********/
+#define VERSION_MAJOR       1
+#define VERSION_MINOR       1
+
+#define NAME_LEN            1024
+
+/********** globals **********/
+uchar image_buf[ NIB_LEN ];
+uchar dsk_buf[ DSK_LEN ];
+
+/********** prototypes **********/
+void create( char *path, int format, int argc, char **argv );
+void add_failed( bundle_t *bundle, char *input, char *name );
+void list( char *path );
+void extract( char *path, int format, int argc, char **argv );
+void extract_one( bundle_t *bundle, int index, int format );
+long read_image( char *path );
+void write_image( char *path, uchar *buf, long len );
+void set_ext( char *dest, char *path, char *ext );
+
+void usage( char *path );
+void fatal( char *format, ... );
+
+int main( int argc, char **argv )
+{
+    int format = -1;
+    char *cmd, *prog = argv[ 0 ];
+
+    printf( "Apple II DSK/NIB Image Bundler Version %d.%d\n\n",
+        VERSION_MAJOR, VERSION_MINOR );
+
+    //
+    // Check args
+    //
+    if ( argc < 3 )
+        usage( argv[ 0 ] );
+    cmd = argv[ 1 ];
+
+    if ( strcmp( argv[ 2 ], "-d" ) == 0 || strcmp( argv[ 2 ], "-n" ) == 0 ) {
+        format = ( argv[ 2 ][ 1 ] == 'd' ) ? DISK_DSK : DISK_NIB;
+        --argc;
+        ++argv;
+        if ( argc < 3 )
+            usage( prog );
+    }
+
+    if ( strcmp( cmd, "c" ) == 0 && argc > 3 )
+        create( argv[ 2 ], format, argc - 3, argv + 3 );
+    else if ( strcmp( cmd, "t" ) == 0 && argc == 3 && format == -1 )
+        list( argv[ 2 ] );
+    else if ( strcmp( cmd, "x" ) == 0 )
+        extract( argv[ 2 ], format, argc - 3, argv + 3 );
+    else
+        usage( prog );
+
+    return 0;
+}
+
+//
+// Create bundle from image files, optionally converting them
+//
+void create( char *path, int format, int argc, char **argv )
+{
+    int i, trk, volume, kind;
+    long len, nsectors = 0;
+    char name[ NAME_LEN ];
+    bundle_t *bundle;
+    geom_t *geom;
+
+    if ( ( bundle = bundle_create( path ) ) == NULL )
+        fatal( "cannot open %s for writing", path );
+
+    for ( i = 0; i < argc; i++ ) {
+        len = read_image( argv[ i ] );
+        printf( "Adding %s\n", argv[ i ] );
+
+        if ( len == NIB_LEN && format == DISK_DSK ) {
+
+            //
+            // Convert NIB => DSK or D13
+            //
+            if ( ( geom = nib_track_geom( image_buf ) ) == NULL )
+                fatal( "%s: cannot decode track 0", argv[ i ] );
+            for ( trk = 0; trk < TRACKS_PER_DISK; trk++ )
+                if ( nib_decode_track( geom, dsk_buf +
+                    trk * geom->sectors * BYTES_PER_SECTOR,
+                    image_buf + trk * BYTES_PER_NIB_TRACK, trk, &volume ) )
+                        fatal( "%s: cannot decode track %d", argv[ i ], trk );
+            if ( geom == &geom_16 ) {
+                set_ext( name, argv[ i ], ".dsk" );
+                kind = BUNDLE_DSK;
+            } else {
+                set_ext( name, argv[ i ], ".d13" );
+                kind = BUNDLE_D13;
+            }
+
+        } else if ( len != NIB_LEN && format == DISK_NIB ) {
+
+            //
+            // Convert DSK or D13 => NIB (re-encoded on extraction)
+            //
+            memcpy( dsk_buf, image_buf, len );
+            set_ext( name, argv[ i ], ".nib" );
+            kind = ( len == DSK_LEN ) ? BUNDLE_NIB : BUNDLE_NIB13;
+            volume = DEFAULT_VOLUME;
+
+        } else {
+            set_ext( name, argv[ i ], NULL );
+            if ( bundle_add( bundle, name, image_buf, len ) )
+                add_failed( bundle, argv[ i ], name );
+            nsectors += len / BUNDLE_BLOCK_LEN;
+            continue;
+        }
+
+        if ( bundle_add_sectors( bundle, name, dsk_buf, kind, volume ) )
+            add_failed( bundle, argv[ i ], name );
+        nsectors += bundle_kind_blocks( kind );
+    }
+
+    if ( bundle_finish( bundle ) )
+        fatal( "bundle write error" );
+
+    //
+    // Report dedup savings
+    //
+    if ( ( bundle = bundle_open( path ) ) == NULL )
+        fatal( "cannot open %s for reading", path );
+    printf( "\n%d images, %ld blocks, %d unique\n", bundle_count( bundle ),
+        nsectors, bundle_blocks( bundle ) );
+    bundle_close( bundle );
+}
+
+//
+// Report why an image could not be added
+// Entries are named by base name, so images from different directories
+// may clash
+//
+void add_failed( bundle_t *bundle, char *input, char *name )
+{
+    if ( bundle_added( bundle, name ) )
+        fatal( "%s: %s is already in the bundle", input, name );
+
+    fatal( "bundle write error" );
+}
+
+//
+// List bundle contents
+//
+void list( char *path )
+{
+    int i;
+    bundle_t *bundle;
+    bundle_entry_t *entry;
+    static char *kinds[] = { "DSK", "NIB", "NIB (raw)", "D13", "NIB (13)" };
+
+    if ( ( bundle = bundle_open( path ) ) == NULL )
+        fatal( "cannot open %s for reading", path );
+
+    for ( i = 0; i < bundle_count( bundle ); i++ ) {
+        entry = bundle_entry( bundle, i );
+        if ( entry->kind == BUNDLE_NIB || entry->kind == BUNDLE_NIB13 )
+            printf( "%-40s %s [Volume:%03d]\n", bundle_name( bundle, i ),
+                kinds[ entry->kind ], entry->volume );
+        else
+            printf( "%-40s %s\n", bundle_name( bundle, i ),
+                kinds[ entry->kind ] );
+    }
+
+    bundle_close( bundle );
+}
+
+//
+// Extract named images, or all of them
+//
+void extract( char *path, int format, int argc, char **argv )
+{
+    int i, index;
+    bundle_t *bundle;
+
+    if ( ( bundle = bundle_open( path ) ) == NULL )
+        fatal( "cannot open %s for reading", path );
+
+    if ( argc == 0 )
+        for ( i = 0; i < bundle_count( bundle ); i++ )
+            extract_one( bundle, i, format );
+
+    for ( i = 0; i < argc; i++ ) {
+        if ( ( index = bundle_find( bundle, argv[ i ] ) ) == -1 )
+            fatal( "%s not found in %s", argv[ i ], path );
+        extract_one( bundle, index, format );
+    }
+
+    bundle_close( bundle );
+}
+
+//
+// Extract one image in its own format or the requested one
+//
+void extract_one( bundle_t *bundle, int index, int format )
+{
+    long len;
+    int kind = bundle_entry( bundle, index )->kind;
+    char name[ NAME_LEN ];
+
+    if ( format == -1 )
+        format = ( kind == BUNDLE_DSK || kind == BUNDLE_D13 ) ?
+            DISK_DSK : DISK_NIB;
+
+    if ( ( len = bundle_extract( bundle, index, format, image_buf ) ) == -1 )
+        fatal( "%s: cannot decode NIB", bundle_name( bundle, index ) );
+
+    set_ext( name, bundle_name( bundle, index ), ( len == NIB_LEN ) ? ".nib" :
+        ( len == D13_LEN ) ? ".d13" : ".dsk" );
+    printf( "Extracting %s => %s\n", bundle_name( bundle, index ), name );
+
+    write_image( name, image_buf, len );
+}
+
+//
+// Read DSK, D13 or NIB image file into image_buf
+//
+long read_image( char *path )
+{
+    int fd;
+    struct stat st;
+
+    if ( ( fd = open( path, O_RDONLY ) ) == -1 )
+        fatal( "cannot open %s for reading", path );
+
+    if ( fstat( fd, &st ) == -1 ||
+         ( st.st_size != DSK_LEN && st.st_size != D13_LEN &&
+           st.st_size != NIB_LEN ) )
+            fatal( "%s is not a DSK, D13 or NIB image", path );
+
+    if ( read( fd, image_buf, st.st_size ) != st.st_size )
+        fatal( "read error" );
+
+    close( fd );
+
+    return st.st_size;
+}
+
+//
+// Write image file
+//
+void write_image( char *path, uchar *buf, long len )
+{
+    int fd;
+
+    if ( ( fd = atomic_create( path ) ) == -1 )
+        fatal( "cannot open %s for writing", path );
+
+    if ( write( fd, buf, len ) != len )
+        fatal( "write failure" );
+
+    if ( atomic_commit( fd ) )
+        fatal( "cannot write %s", path );
+}
+
+//
+// Copy base name of path, replacing its extension with ext (NULL to
+// keep it)
+//
+void set_ext( char *dest, char *path, char *ext )
+{
+    char *base, *dot;
+
+    if ( ( base = strrchr( path, '/' ) ) != NULL )
+        path = base + 1;
+
+    snprintf( dest, NAME_LEN - 4, "%s", path );
+    if ( ext == NULL )
+        return;
+
+    if ( ( dot = strrchr( dest, '.' ) ) == NULL )
+        dot = dest + strlen( dest );
+    strcpy( dot, ext );
+}
+
+/************************* Utility Routines *************************/
+
+//
+// Usage info
+//
+void usage( char *path )
+{
+    printf( "Usage: %s c [-d|-n] <bundle> <file>...\n", path );
+    printf( "       %s t <bundle>\n", path );
+    printf( "       %s x [-d|-n] <bundle> [<name>...]\n", path );
+    printf( "Where: c creates <bundle> from DSK, D13 and NIB files\n" );
+    printf( "       t lists the images in <bundle>\n" );
+    printf( "       x extracts the named images (all by default)\n" );
+    printf( "       -d converts images to DSK, -n converts images to NIB\n" );
+
+    exit( 1 );
+}
+
+//
+// Fatal
+//
+void fatal( char *format, ... )
+{
+    va_list argp;
+
+    printf( "\nFatal: " );
+
+    va_start( argp, format );
+    vprintf( format, argp );
+    va_end( argp );
+
+    printf( "\n" );
+
+    atomic_abort();
+
+    exit( 1 );
+}
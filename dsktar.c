@@ -0,0 +1,501 @@
+//
+// dsktar.c - convert the DSK and NIB members of a tar stream
+// Copyright (C) 1996, 2017 slotek@nym.hush.com
+//
+// Reads a tar archive on stdin and writes it to stdout in one pass.
+// Regular members named *.dsk or *.d13 with an image's length are
+// encoded to NIB, and *.nib members are decoded to DSK (or D13), using
+// the disk routines' track codec. Converted members are renamed to the
+// new extension; every other member, and any image that does not
+// convert, passes through byte for byte. Messages go to stderr.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "codec.h"
+
+/********** symbolic constants **********/
+#define VERSION_MAJOR       1
+#define VERSION_MINOR       0
+
+#define BLOCK_LEN           512
+
+#define NAME_OFF            0       // ustar header fields
+#define NAME_LEN            100
+#define SIZE_OFF            124
+#define SIZE_LEN            12
+#define CHKSUM_OFF          148
+#define CHKSUM_LEN          8
+#define TYPE_OFF            156
+#define MAGIC_OFF           257
+#define PREFIX_OFF          345
+#define PREFIX_LEN          155
+
+#define TYPE_FILE           '0'
+#define TYPE_OLD_FILE       '\0'
+#define TYPE_LONG_NAME      'L'     // GNU: next member's name
+#define TYPE_LONG_LINK      'K'
+#define TYPE_PAX            'x'     // POSIX: next member's attributes
+
+#define EXT_LEN             4
+
+/********** globals **********/
+int to_nib = 1, to_dsk = 1;
+uchar in_buf[ NIB_LEN ];
+uchar out_buf[ NIB_LEN ];
+
+uchar *ext_buf;                         // pending long name / pax records
+long ext_len, ext_max;
+char *ext_name;                         // name within ext_buf, or NULL
+int ext_name_len;
+char *ext_size;                         // pax size value, or NULL
+int ext_size_len;
+
+/********** prototypes **********/
+void transcode( void );
+void member( uchar *hdr, long size );
+long convert( char *name, long len, char *ext, char *new_ext );
+void add_ext( uchar *hdr, long size );
+char *pax_value( char *buf, long len, char *key, int *value_len );
+char *image_ext( char *name, int len );
+void set_size( uchar *hdr, long size );
+int check_header( uchar *hdr );
+long get_size( uchar *hdr );
+long padded( long size );
+void copy_data( long size );
+int read_full( uchar *buf, long len );
+void write_full( uchar *buf, long len );
+
+void usage( char *path );
+void fatal( char *format, ... );
+
+int main( int argc, char **argv )
+{
+    fprintf( stderr, "Apple II DSK/NIB Tar Converter Version %d.%d\n\n",
+        VERSION_MAJOR, VERSION_MINOR );
+
+    //
+    // Check args
+    //
+    if ( argc > 2 || isatty( 0 ) || isatty( 1 ) )
+        usage( argv[ 0 ] );
+    if ( argc == 2 ) {
+        if ( strcmp( argv[ 1 ], "-n" ) == 0 )
+            to_dsk = 0;
+        else if ( strcmp( argv[ 1 ], "-d" ) == 0 )
+            to_nib = 0;
+        else
+            usage( argv[ 0 ] );
+    }
+
+    transcode();
+
+    return 0;
+}
+
+//
+// Copy tar stream from stdin to stdout, converting image members
+//
+void transcode( void )
+{
+    uchar hdr[ BLOCK_LEN ], zero[ BLOCK_LEN ];
+    long size;
+    int type;
+
+    memset( zero, 0, BLOCK_LEN );
+
+    while ( read_full( hdr, BLOCK_LEN ) ) {
+
+        //
+        // End of archive: pass the rest through
+        //
+        if ( memcmp( hdr, zero, BLOCK_LEN ) == 0 ) {
+            write_full( hdr, BLOCK_LEN );
+            while ( read_full( hdr, BLOCK_LEN ) )
+                write_full( hdr, BLOCK_LEN );
+            break;
+        }
+
+        if ( check_header( hdr ) )
+            fatal( "stdin is not a tar stream" );
+
+        size = get_size( hdr );
+        type = hdr[ TYPE_OFF ];
+
+        if ( type == TYPE_LONG_NAME || type == TYPE_LONG_LINK ||
+             type == TYPE_PAX )
+                add_ext( hdr, size );
+        else
+            member( hdr, size );
+    }
+
+    if ( ext_len )
+        write_full( ext_buf, ext_len );
+}
+
+//
+// Pass one member through, converted if it is a DSK or NIB image
+//
+void member( uchar *hdr, long size )
+{
+    char name[ PREFIX_LEN + 1 + NAME_LEN + 1 ], *ext, new_ext[ EXT_LEN + 1 ];
+    char size_str[ 8 ];
+    long len = -1;
+    int type = hdr[ TYPE_OFF ];
+
+    //
+    // Full name from a long name or pax record, else from the header
+    //
+    if ( ext_name )
+        snprintf( name, sizeof( name ), "%.*s", ext_name_len, ext_name );
+    else if ( hdr[ PREFIX_OFF ] )
+        snprintf( name, sizeof( name ), "%.*s/%.*s", PREFIX_LEN,
+            hdr + PREFIX_OFF, NAME_LEN, hdr + NAME_OFF );
+    else
+        snprintf( name, sizeof( name ), "%.*s", NAME_LEN, hdr + NAME_OFF );
+
+    ext = image_ext( name, strlen( name ) );
+    if ( ( type != TYPE_FILE && type != TYPE_OLD_FILE ) || ext == NULL ||
+         ( size != DSK_LEN && size != D13_LEN && size != NIB_LEN ) ) {
+            write_full( ext_buf, ext_len );
+            write_full( hdr, BLOCK_LEN );
+            copy_data( size );
+            ext_len = 0;
+            ext_name = ext_size = NULL;
+            return;
+    }
+
+    if ( !read_full( in_buf, padded( size ) ) )
+        fatal( "unexpected end of tar stream" );
+
+    //
+    // Rename in every record that holds the name, and resize
+    //
+    if ( ( len = convert( name, size, ext, new_ext ) ) != -1 ) {
+        fprintf( stderr, "Converting %s => %.*s%s\n", name,
+            (int) ( ext - name ), name, new_ext );
+
+        if ( ext_name && ( ext = image_ext( ext_name, ext_name_len ) ) )
+            memcpy( ext, new_ext, EXT_LEN );
+        if ( ext_size && ext_size_len == 6 ) {
+            snprintf( size_str, sizeof( size_str ), "%06ld", len );
+            memcpy( ext_size, size_str, 6 );
+        }
+        if ( ( ext = image_ext( (char *) hdr + NAME_OFF,
+            strnlen( (char *) hdr + NAME_OFF, NAME_LEN ) ) ) != NULL )
+                memcpy( ext, new_ext, EXT_LEN );
+        set_size( hdr, len );
+    }
+
+    //
+    // Write extended records, header and data. Names only change their
+    // extension, so extended records keep their length.
+    //
+    write_full( ext_buf, ext_len );
+    write_full( hdr, BLOCK_LEN );
+    if ( len == -1 )
+        write_full( in_buf, padded( size ) );
+    else {
+        memset( out_buf + len, 0, padded( len ) - len );
+        write_full( out_buf, padded( len ) );
+    }
+
+    ext_len = 0;
+    ext_name = ext_size = NULL;
+}
+
+//
+// Convert image in in_buf into out_buf
+// Returns the new length and sets new_ext (in the case of ext), or -1 to
+// pass the image through
+//
+long convert( char *name, long len, char *ext, char *new_ext )
+{
+    int i, trk, volume;
+    geom_t *geom;
+
+    if ( strncasecmp( ext, ".nib", EXT_LEN ) ) {
+        if ( !to_nib || len == NIB_LEN )
+            return -1;
+
+        geom = ( len == DSK_LEN ) ? &geom_16 : &geom_13;
+        for ( trk = 0; trk < TRACKS_PER_DISK; trk++ )
+            nib_encode_track( geom, out_buf + trk * BYTES_PER_NIB_TRACK,
+                in_buf + trk * geom->sectors * BYTES_PER_SECTOR,
+                DEFAULT_VOLUME, trk );
+        strcpy( new_ext, ".nib" );
+        len = NIB_LEN;
+
+    } else {
+        if ( !to_dsk || len != NIB_LEN )
+            return -1;
+
+        if ( ( geom = nib_track_geom( in_buf ) ) == NULL ) {
+            fprintf( stderr, "Warning: %s: no address field, passed "
+                "through\n", name );
+            return -1;
+        }
+        for ( trk = 0; trk < TRACKS_PER_DISK; trk++ )
+            if ( nib_decode_track( geom, out_buf +
+                trk * geom->sectors * BYTES_PER_SECTOR,
+                in_buf + trk * BYTES_PER_NIB_TRACK, trk, &volume ) ) {
+                    fprintf( stderr, "Warning: %s: cannot decode track %d, "
+                        "passed through\n", name, trk );
+                    return -1;
+            }
+        strcpy( new_ext, ( geom == &geom_16 ) ? ".dsk" : ".d13" );
+        len = geom->dsk_len;
+    }
+
+    //
+    // Keep upper case names upper case
+    //
+    if ( ext[ 1 ] >= 'A' && ext[ 1 ] <= 'Z' )
+        for ( i = 1; i < EXT_LEN; i++ )
+            if ( new_ext[ i ] >= 'a' && new_ext[ i ] <= 'z' )
+                new_ext[ i ] -= 'a' - 'A';
+
+    return len;
+}
+
+//
+// Keep a GNU long name or pax record for the next member
+//
+void add_ext( uchar *hdr, long size )
+{
+    long need = ext_len + BLOCK_LEN + padded( size );
+    uchar *p;
+    char *value;
+    int value_len;
+
+    if ( need > ext_max ) {
+        if ( ( p = (uchar *) realloc( ext_buf, need ) ) == NULL )
+            fatal( "cannot allocate %ld bytes", need );
+        ext_buf = p;
+        ext_max = need;
+    }
+
+    memcpy( ext_buf + ext_len, hdr, BLOCK_LEN );
+    if ( !read_full( ext_buf + ext_len + BLOCK_LEN, padded( size ) ) )
+        fatal( "unexpected end of tar stream" );
+    ext_len = need;
+
+    //
+    // Locate the name (and pax size) in all records kept so far, as
+    // realloc() may have moved them
+    //
+    ext_name = ext_size = NULL;
+    for ( p = ext_buf; p < ext_buf + ext_len;
+        p += BLOCK_LEN + padded( size ) ) {
+            size = get_size( p );
+
+            if ( p[ TYPE_OFF ] == TYPE_LONG_NAME ) {
+                ext_name = (char *) p + BLOCK_LEN;
+                ext_name_len = strnlen( ext_name, size );
+            } else if ( p[ TYPE_OFF ] == TYPE_PAX ) {
+                if ( ( value = pax_value( (char *) p + BLOCK_LEN, size,
+                    "path", &value_len ) ) != NULL ) {
+                        ext_name = value;
+                        ext_name_len = value_len;
+                }
+                if ( ( value = pax_value( (char *) p + BLOCK_LEN, size,
+                    "size", &value_len ) ) != NULL ) {
+                        ext_size = value;
+                        ext_size_len = value_len;
+                }
+            }
+    }
+}
+
+//
+// Find the value of a key in pax records ("<len> <key>=<value>\n")
+//
+char *pax_value( char *buf, long len, char *key, int *value_len )
+{
+    char *p = buf, *end = buf + len, *eq;
+    long n;
+    int key_len = strlen( key );
+
+    while ( p < end && *p >= '0' && *p <= '9' ) {
+        n = strtol( p, NULL, 10 );
+        if ( n <= 0 || n > end - p )
+            break;
+        if ( ( eq = memchr( p, ' ', n ) ) != NULL &&
+             eq + 1 + key_len < p + n && eq[ 1 + key_len ] == '=' &&
+             memcmp( eq + 1, key, key_len ) == 0 ) {
+                *value_len = ( p + n - 1 ) - ( eq + 2 + key_len );
+                return eq + 2 + key_len;
+        }
+        p += n;
+    }
+
+    return NULL;
+}
+
+//
+// Return pointer to a .dsk, .d13 or .nib extension ending name, or NULL
+//
+char *image_ext( char *name, int len )
+{
+    char *ext = name + len - EXT_LEN;
+
+    if ( len < EXT_LEN + 1 || ext[ -1 ] == '/' )
+        return NULL;
+
+    if ( strncasecmp( ext, ".dsk", EXT_LEN ) &&
+         strncasecmp( ext, ".d13", EXT_LEN ) &&
+         strncasecmp( ext, ".nib", EXT_LEN ) )
+            return NULL;
+
+    return ext;
+}
+
+/************************* Tar Routines *************************/
+
+//
+// Set member size and recompute header checksum
+//
+void set_size( uchar *hdr, long size )
+{
+    int i;
+    unsigned sum = 0;
+
+    snprintf( (char *) hdr + SIZE_OFF, SIZE_LEN, "%011lo", size );
+
+    memset( hdr + CHKSUM_OFF, ' ', CHKSUM_LEN );
+    for ( i = 0; i < BLOCK_LEN; i++ )
+        sum += hdr[ i ];
+    snprintf( (char *) hdr + CHKSUM_OFF, CHKSUM_LEN, "%06o", sum );
+    hdr[ CHKSUM_OFF + CHKSUM_LEN - 1 ] = ' ';
+}
+
+//
+// Check header checksum
+// Returns -1 if it does not match
+//
+int check_header( uchar *hdr )
+{
+    int i;
+    unsigned sum = 0;
+
+    for ( i = 0; i < BLOCK_LEN; i++ )
+        sum += ( i >= CHKSUM_OFF && i < CHKSUM_OFF + CHKSUM_LEN ) ?
+            ' ' : hdr[ i ];
+
+    return ( strtoul( (char *) hdr + CHKSUM_OFF, NULL, 8 ) == sum ) ? 0 : -1;
+}
+
+//
+// Return member size (octal, or base-256 for large GNU members)
+//
+long get_size( uchar *hdr )
+{
+    char field[ SIZE_LEN + 1 ];
+    long size = 0;
+    int i;
+
+    if ( hdr[ SIZE_OFF ] & 0x80 ) {
+        for ( i = 1; i < SIZE_LEN; i++ )
+            size = ( size << 8 ) | hdr[ SIZE_OFF + i ];
+        return size;
+    }
+
+    memcpy( field, hdr + SIZE_OFF, SIZE_LEN );
+    field[ SIZE_LEN ] = '\0';
+
+    return strtol( field, NULL, 8 );
+}
+
+//
+// Round size up to whole blocks
+//
+long padded( long size )
+{
+    return ( size + BLOCK_LEN - 1 ) / BLOCK_LEN * BLOCK_LEN;
+}
+
+//
+// Copy member data (padded to whole blocks) from stdin to stdout
+//
+void copy_data( long size )
+{
+    long n;
+
+    for ( size = padded( size ); size > 0; size -= n ) {
+        n = ( size < NIB_LEN ) ? size : NIB_LEN;
+        if ( !read_full( in_buf, n ) )
+            fatal( "unexpected end of tar stream" );
+        write_full( in_buf, n );
+    }
+}
+
+//
+// Read len bytes from stdin
+// Returns 0 at end of file
+//
+int read_full( uchar *buf, long len )
+{
+    long n;
+
+    while ( len > 0 ) {
+        if ( ( n = read( 0, buf, len ) ) <= 0 )
+            return 0;
+        buf += n;
+        len -= n;
+    }
+
+    return 1;
+}
+
+//
+// Write len bytes to stdout
+//
+void write_full( uchar *buf, long len )
+{
+    long n;
+
+    while ( len > 0 ) {
+        if ( ( n = write( 1, buf, len ) ) <= 0 )
+            fatal( "write failure" );
+        buf += n;
+        len -= n;
+    }
+}
+
+/************************* Utility Routines *************************/
+
+//
+// Usage info
+//
+void usage( char *path )
+{
+    fprintf( stderr, "Usage: %s [-d|-n] < <tarfile> > <tarfile>\n", path );
+    fprintf( stderr, "Where: DSK and D13 members are converted to NIB, NIB "
+        "members to DSK\n" );
+    fprintf( stderr, "       -d only converts to DSK, -n only converts to "
+        "NIB\n" );
+
+    exit( 1 );
+}
+
+//
+// Fatal
+//
+void fatal( char *format, ... )
+{
+    va_list argp;
+
+    fprintf( stderr, "\nFatal: " );
+
+    va_start( argp, format );
+    vfprintf( stderr, format, argp );
+    va_end( argp );
+
+    fprintf( stderr, "\n" );
+
+    exit( 1 );
+}
@@ -1,570 +1,614 @@
-//
-// nib2dsk.c - convert Apple II NIB image file into DSK file
-// Copyright (C) 1996, 2017 slotek@nym.hush.com
-//
-#include <stdio.h>
-#include <stdlib.h>
-#include <stdarg.h>
-#include <fcntl.h>
-#include <string.h>
-#include <unistd.h>
-#include <sys/stat.h>
-
-/********** Symbolic Constants **********/
-#define VERSION_MAJOR       1
-#define VERSION_MINOR       1
-
-#define TRACKS_PER_DISK     35
-#define SECTORS_PER_TRACK   16
-#define BYTES_PER_SECTOR    256
-#define BYTES_PER_TRACK     4096
-#define DSK_LEN             143360L
-
-#define PRIMARY_BUF_LEN     256
-#define SECONDARY_BUF_LEN   86
-#define DATA_LEN            (PRIMARY_BUF_LEN+SECONDARY_BUF_LEN)
-
-/********** Typedefs **********/
-typedef unsigned char uchar;
-
-/********** Statics **********/
-static uchar addr_prolog[] = { 0xd5, 0xaa, 0x96 };
-static uchar addr_epilog[] = { 0xde, 0xaa, 0xeb };
-static uchar data_prolog[] = { 0xd5, 0xaa, 0xad };
-static uchar data_epilog[] = { 0xde, 0xaa, 0xeb };
-static int interleave[ SECTORS_PER_TRACK ] =
-    { 0, 7, 0xE, 6, 0xD, 5, 0xC, 4, 0xB, 3, 0xA, 2, 9, 1, 8, 0xF };
-
-/********** Globals **********/
-int infd, outfd;
-uchar sector, track, volume;
-uchar primary_buf[ PRIMARY_BUF_LEN ];
-uchar secondary_buf[ SECONDARY_BUF_LEN ];
-uchar *dsk_buf[ TRACKS_PER_DISK ];
-
-/********** Prototypes **********/
-void convert_image( void );
-void process_data( uchar byte );
-uchar odd_even_decode( uchar byte1, uchar byte2 );
-uchar untranslate( uchar x );
-int get_byte( uchar *byte );
-void dsk_init( void );
-void dsk_reset( void );
-void dsk_write( void );
-void usage( char *path );
-void myprintf( char *format, ... );
-void fatal( char *format, ... );
-void ueof( int state );
-
-int main( int argc, char **argv )
-{
-    int i;
-
-    printf( "Apple II NIB to DSK Image Converter Version %d.%d\n\n",
-        VERSION_MAJOR, VERSION_MINOR );
-
-    //
-    // Check args
-    //
-    if ( argc != 3 )
-        usage( argv[ 0 ] );
-
-    //
-    // Init dsk_buf and open files
-    //
-    dsk_init();
-
-    if ( ( infd = open( argv[ 1 ], O_RDONLY ) ) == -1 )
-        fatal( "cannot open %s for reading", argv[ 1 ] );
-
-    if ( ( outfd = open( argv[ 2 ], O_RDWR | O_CREAT | O_TRUNC,
-        S_IREAD | S_IWRITE ) ) == -1 )
-            fatal( "cannot open %s for writing", argv[ 2 ] );
-
-    //
-    // Do conversion and write DSK file
-    //
-    printf( "Converting %s => %s\n", argv[ 1 ], argv[ 2 ] );
-    convert_image();
-    dsk_write();
-
-    //
-    // Close files & free dsk
-    //
-    close( infd );
-    close( outfd );
-    dsk_reset();
-
-    myprintf("\n");
-
-    return 0;
-}
-
-//
-// Convert NIB image into DSK image
-//
-#define STATE_INIT  0
-#define STATE_DONE  666
-void convert_image( void )
-{
-    int state;
-    int addr_prolog_index, addr_epilog_index;
-    int data_prolog_index, data_epilog_index;
-    uchar byte;
-
-    //
-    // Image conversion FSM
-    //
-    if ( get_byte( &byte ) == 0 )
-        ueof( state );
-
-    for ( state = STATE_INIT; state != STATE_DONE; ) {
-
-        switch( state ) {
-
-            //
-            // Scan for 1st addr prolog byte (skip gap bytes)
-            //
-            case 0:
-                addr_prolog_index = 0;
-                if ( byte == addr_prolog[ addr_prolog_index ] ) {
-                    ++addr_prolog_index;
-                    ++state;
-                }
-                if ( get_byte( &byte ) == 0 )
-                    state = STATE_DONE;
-                break;
-
-            //
-            // Accept 2nd and 3rd addr prolog bytes
-            //
-            case 1:
-            case 2:
-                if ( byte == addr_prolog[ addr_prolog_index ] ) {
-                    ++addr_prolog_index;
-                    ++state;
-                    if ( get_byte( &byte ) == 0 )
-                        ueof( state );
-                } else
-                    state = 0;
-                break;
-
-            //
-            // Read and decode volume number
-            //
-            case 3:
-            {
-                uchar byte2;
-                if ( get_byte( &byte2 ) == 0 )
-                    ueof( state );
-                volume = odd_even_decode( byte, byte2 );
-                myprintf( "V:%02x ", volume );
-                myprintf( "{%02x%02x}\n", byte, byte2 );
-                ++state;
-                if ( get_byte( &byte ) == 0 )
-                    ueof( state );
-                break;
-            }
-
-            //
-            // Read and decode track number
-            //
-            case 4:
-            {
-                uchar byte2;
-                if ( get_byte( &byte2 ) == 0 )
-                    ueof( state );
-                track = odd_even_decode( byte, byte2 );
-                myprintf( "T:%02x ", track );
-                myprintf( "{%02x%02x}\n", byte, byte2 );
-                ++state;
-                if ( get_byte( &byte ) == 0 )
-                    ueof( state );
-                break;
-            }
-
-            //
-            // Read and decode sector number
-            //
-            case 5:
-            {
-                uchar byte2;
-                if ( get_byte( &byte2 ) == 0 )
-                    ueof( state );
-                sector = odd_even_decode( byte, byte2 );
-                myprintf( "S:%02x ", sector );
-                myprintf( "{%02x%02x}\n", byte, byte2 );
-                ++state;
-                if ( get_byte( &byte ) == 0 )
-                    ueof( state );
-                break;
-            }
-
-            //
-            // Read and decode addr field checksum
-            //
-            case 6:
-            {
-                uchar byte2, csum;
-                if ( get_byte( &byte2 ) == 0 )
-                    ueof( state );
-                csum = odd_even_decode( byte, byte2 );
-                myprintf( "C:%02x ", csum );
-                myprintf( "{%02x%02x} -\n", byte, byte2 );
-                ++state;
-                if ( get_byte( &byte ) == 0 )
-                    ueof( state );
-                break;
-            }
-
-            //
-            // Accept 1st addr epilog byte
-            //
-            case 7:
-                addr_epilog_index = 0;
-                if ( byte == addr_epilog[ addr_epilog_index ] ) {
-                    ++addr_epilog_index;
-                    ++state;
-                    if ( get_byte( &byte ) == 0 )
-                        ueof( state );
-                } else {
-                    myprintf( "Reset!\n" );
-                    state = 0;
-                }
-                break;
-
-            //
-            // Accept 2nd addr epilog byte
-            //
-            case 8:
-                if ( byte == addr_epilog[ addr_epilog_index ] ) {
-                    ++state;
-                    if ( get_byte( &byte ) == 0 )
-                        ueof( state );
-                } else {
-                    myprintf( "Reset!\n" );
-                    state = 0;
-                }
-                break;
-
-            //
-            // Scan for 1st data prolog byte (skip gap bytes)
-            //
-            case 9:
-                data_prolog_index = 0;
-                if ( byte == data_prolog[ data_prolog_index ] ) {
-                    ++data_prolog_index;
-                    ++state;
-                }
-                if ( get_byte( &byte ) == 0 )
-                    ueof( state );
-                break;
-
-            //
-            // Accept 2nd and 3rd data prolog bytes
-            //
-            case 10:
-            case 11:
-                if ( byte == data_prolog[ data_prolog_index ] ) {
-                    ++data_prolog_index;
-                    ++state;
-                    if ( get_byte( &byte ) == 0 )
-                        ueof( state );
-                } else {
-		    myprintf( "%s byte was %02x, "
-			      "expecting data prolog of %02x %02x %02x\n",
-			      ( data_prolog_index == 1 ) ? "Second" : "Third",
-			      byte,
-			      data_prolog[ 0 ],
-			      data_prolog[ 1 ],
-			      data_prolog[ 2 ] );
-                    state = 9;
-		}
-                break;
-
-            //
-            // Process data
-            //
-            case 12:
-                process_data( byte );
-                myprintf( "OK!\n" );
-                ++state;
-                if ( get_byte( &byte ) == 0 )
-                    ueof( state );
-                break;
-
-            //
-            // Scan(!) for 1st data epilog byte
-            //
-            case 13:
-            {
-                static int extra = 0;
-                data_epilog_index = 0;
-                if ( byte == data_epilog[ data_epilog_index ] ) {
-                    if ( extra ) {
-                        printf( "Warning: %d extra bytes before data epilog\n",
-                            extra );
-                        extra = 0;
-                    }
-                    ++data_epilog_index;
-                    ++state;
-                } else
-                    ++extra;
-                if ( get_byte( &byte ) == 0 )
-                    ueof( state );
-                break;
-            }
-
-            //
-            // Accept 2nd data epilog byte
-            //
-            case 14:
-                if ( byte == data_epilog[ data_epilog_index ] ) {
-                    ++data_epilog_index;
-                    ++state;
-                    if ( get_byte( &byte ) == 0 )
-                        ueof( state );
-                } else
-                    fatal( "data epilog mismatch (%02x)\n", byte );
-                break;
-
-            //
-            // Accept 3rd data epilog byte
-            //
-            case 15:
-                if ( byte == data_epilog[ data_epilog_index ] ) {
-                    if ( get_byte( &byte ) == 0 )
-                        state = STATE_DONE;
-                    else
-                        state = 0;
-                } else
-                    fatal( "data epilog mismatch (%02x)\n", byte );
-                break;
-
-            default:
-                fatal( "Undefined state!" );
-                break;
-        }
-    }
-}
-
-//
-// Convert 343 6+2 encoded bytes into 256 data bytes and 1 checksum
-//
-void process_data( uchar byte )
-{
-    int i, sec;
-    uchar checksum;
-    uchar bit0, bit1;
-
-    //
-    // Fill primary and secondary buffers according to iterative formula:
-    //    buf[0] = trans(byte[0])
-    //    buf[1] = trans(byte[1]) ^ buf[0]
-    //    buf[n] = trans(byte[n]) ^ buf[n-1]
-    //
-    checksum = untranslate( byte );
-    secondary_buf[ 0 ] = checksum;
-
-    for ( i = 1; i < SECONDARY_BUF_LEN; i++ ) {
-        if ( get_byte( &byte ) == 0 )
-            fatal( "Unexpected End of File in process_data()" );
-        checksum ^= untranslate( byte );
-        secondary_buf[ i ] = checksum;
-    }
-
-    for ( i = 0; i < PRIMARY_BUF_LEN; i++ ) {
-        if ( get_byte( &byte ) == 0 )
-            fatal( "Unexpected End of File in process_data()" );
-        checksum ^= untranslate( byte );
-        primary_buf[ i ] = checksum;
-    }
-
-    //
-    // Validate resultant checksum
-    //
-    if ( get_byte( &byte ) == 0 )
-      fatal( "Unexpected End of File in process_data()" );
-    checksum ^= untranslate( byte );
-    if ( checksum != 0 )
-        printf( "Warning: data checksum mismatch\n" );
-
-    //
-    // Denibbilize
-    //
-    for ( i = 0; i < PRIMARY_BUF_LEN; i++ ) {
-        int index = i % SECONDARY_BUF_LEN;
-
-        switch( i / SECONDARY_BUF_LEN ) {
-            case 0:
-                bit0 = ( secondary_buf[ index ] & 2 ) > 0;
-                bit1 = ( secondary_buf[ index ] & 1 ) > 0;
-                break;
-            case 1:
-                bit0 = ( secondary_buf[ index ] & 8 ) > 0;
-                bit1 = ( secondary_buf[ index ] & 4 ) > 0;
-                break;
-            case 2:
-                bit0 = ( secondary_buf[ index ] & 0x20 ) > 0;
-                bit1 = ( secondary_buf[ index ] & 0x10 ) > 0;
-                break;
-            default:
-                fatal( "huh?" );
-                break;
-        }
-
-        sec = interleave[ sector ];
-
-        *( dsk_buf[ track ] + (sec*BYTES_PER_SECTOR) + i )
-            = ( primary_buf[ i ] << 2 ) | ( bit1 << 1 ) | bit0;
-    }
-}
-
-//
-// decode 2 "4 and 4" bytes into 1 byte
-//
-uchar odd_even_decode( uchar byte1, uchar byte2 )
-{
-    uchar byte;
-
-    byte = ( byte1 << 1 ) & 0xaa;
-    byte |= byte2 & 0x55;
-
-    return byte;
-}
-
-//
-// do "6 and 2" un-translation
-//
-#define TABLE_SIZE 0x40
-static uchar table[ TABLE_SIZE ] = {
-    0x96, 0x97, 0x9a, 0x9b, 0x9d, 0x9e, 0x9f, 0xa6,
-    0xa7, 0xab, 0xac, 0xad, 0xae, 0xaf, 0xb2, 0xb3,
-    0xb4, 0xb5, 0xb6, 0xb7, 0xb9, 0xba, 0xbb, 0xbc,
-    0xbd, 0xbe, 0xbf, 0xcb, 0xcd, 0xce, 0xcf, 0xd3,
-    0xd6, 0xd7, 0xd9, 0xda, 0xdb, 0xdc, 0xdd, 0xde,
-    0xdf, 0xe5, 0xe6, 0xe7, 0xe9, 0xea, 0xeb, 0xec,
-    0xed, 0xee, 0xef, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6,
-    0xf7, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
-};
-uchar untranslate( uchar x )
-{
-    uchar y;
-    uchar *ptr;
-    int index;
-
-    if ( ( ptr = memchr( table, x, TABLE_SIZE ) ) == NULL )
-        fatal( "Non-translatable byte %02x\n", x );
-
-    index = ptr - table;
-
-    return index;
-}
-
-//
-// Read byte from input file
-// Returns 0 on EOF
-//
-//HACK #define BUFLEN 16384
-#define BUFLEN 232960
-static uchar buf[ BUFLEN ];
-int get_byte( uchar *byte )
-{
-    static int index = BUFLEN;
-    static int buflen = BUFLEN;
-
-    myprintf("\r(%d)", index);
-
-    if ( index >= buflen ) {
-        if ( ( buflen = read( infd, buf, BUFLEN ) ) == -1 )
-            fatal( "read error" );
-        index = 0;
-    }
-
-    *byte = buf[ index++ ];
-    return buflen;
-}
-
-//
-// Alloc dsk_buf
-//
-void dsk_init( void )
-{
-    int i;
-    for ( i = 0; i < TRACKS_PER_DISK; i++ )
-        if ( ( dsk_buf[ i ] = (uchar *) malloc( BYTES_PER_TRACK ) ) == NULL )
-            fatal( "cannot allocate %ld bytes", DSK_LEN );
-}
-
-//
-// Free dsk_buf
-//
-void dsk_reset( void )
-{
-    int i;
-    for ( i = 0; i < TRACKS_PER_DISK; i++ )
-        free( dsk_buf[ i ] );
-}
-
-//
-// Write DSK file
-//
-void dsk_write( void )
-{
-    int i;
-    for ( i = 0; i < TRACKS_PER_DISK; i++ )
-        if ( write( outfd, dsk_buf[ i ], BYTES_PER_TRACK ) != BYTES_PER_TRACK )
-            fatal( "write failure" );
-}
-
-//
-// usage info
-//
-void usage( char *path )
-{
-    printf( "Usage: %s <nibfile> <dskfile>\n", path );
-    printf( "Where: <nibfile> is the input NIB file name\n" );
-    printf( "       <dskfile> is the output DSK file name\n" );
-
-    exit( 1 );
-}
-
-//
-// myprintf
-//
-#pragma argsused
-void myprintf( char *format, ... )
-{
-#ifdef DEBUG
-    va_list argp;
-    va_start( argp, format );
-    vprintf( format, argp );
-    va_end( argp );
-#endif
-}
-
-//
-// fatal
-//
-void fatal( char *format, ... )
-{
-    va_list argp;
-
-    printf( "\nFatal: " );
-
-    va_start( argp, format );
-    vprintf( format, argp );
-    va_end( argp );
-
-    printf( "\n" );
-
-    exit( 1 );
-}
-
-//
-// ueof: fatal unexpected end of file
-//
-void ueof ( int state ) {
-    myprintf ( "In state %d: ", state );
-    fatal( "Unexpected End of File" );
-}
+//
+// nib2dsk.c - convert Apple II NIB image file into DSK file
+// Copyright (C) 1996, 2017 slotek@nym.hush.com
+//
+// Sectors are decoded by the disk routines (see nib_decode_sectors()),
+// so nib2dsk, dskcmp and libdisk.a find the same sectors in a NIB.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "atomic.h"
+#include "batch.h"
+#include "codec.h"
+#include "nibidx.h"
+#include "pipe.h"
+
+/********** Symbolic Constants **********/
+#define VERSION_MAJOR       1
+#define VERSION_MINOR       1
+
+/********** Globals **********/
+geom_t *geom = &geom_16;
+int outfd = -1;
+uchar *nib_buf;
+long nib_len;
+int nib_fd = -1;                        // NIB whose tracks 1-34 are unread
+struct stat nib_st;                     // NIB file status, ties the index
+uchar *dsk_buf;                         // DSK image being decoded
+uchar *dsk_map;                         // mapped output file, if any
+unsigned found[ TRACKS_PER_DISK ];      // sectors decoded, per track
+nib_stats_t stats;                      // decoder counts (see reset_stats())
+
+char *check_path;                       // image being checked (--check)
+char *fail_path;                        // fatal() prefix (--check, --batch)
+char *batch_exts[] = { ".dsk", ".d13", NULL };  // outputs of batch_image()
+
+int index_flag;                         // write sidecar index (--index)
+nibidx_entry_t *idx;                    // sector copies found by the scan
+uint32_t nidx, max_idx;
+uint16_t copies[ TRACKS_PER_DISK ][ SECTORS_PER_TRACK ];
+
+/********** Prototypes **********/
+int check_images( int argc, char **argv );
+int check_image( char *path );
+int batch_image( char *path, char *outdir );
+void convert_file( char *in, char *out );
+int read_index( char *path );
+void write_index( char *path );
+void index_add( nib_field_t *f );
+void convert_image( void );
+void convert_track( int trk, uchar *buf, uchar *unused, void *arg );
+void found_field( nib_field_t *f, void *arg );
+void reset_stats( void );
+int count_missing( void );
+void nib_read( char *path );
+void nib_load( void );
+void find_geom( void );
+void dsk_init( void );
+void dsk_reset( void );
+void dsk_write( void );
+void usage( char *path );
+void myprintf( char *format, ... );
+void fatal( char *format, ... );
+
+int main( int argc, char **argv )
+{
+    int failed;
+
+    printf( "Apple II NIB to DSK Image Converter Version %d.%d\n\n",
+        VERSION_MAJOR, VERSION_MINOR );
+
+    //
+    // Check args
+    //
+    if ( argc > 1 && strcmp( argv[ 1 ], "--index" ) == 0 ) {
+        index_flag = 1;
+        --argc;
+        ++argv;
+    }
+
+    if ( argc > 2 && strcmp( argv[ 1 ], "--check" ) == 0 )
+        return check_images( argc - 2, argv + 2 );
+
+    if ( argc > 4 && strcmp( argv[ 1 ], "--batch" ) == 0 ) {
+        if ( ( failed = batch_run( argv[ 2 ], argv[ 3 ], argc - 4, argv + 4,
+            batch_exts, batch_image ) ) == -1 )
+                fatal( "cannot open journal %s", argv[ 2 ] );
+        return failed != 0;
+    }
+
+    if ( argc != 3 )
+        usage( argv[ 0 ] );
+
+    //
+    // Read NIB image and convert it
+    //
+    nib_read( argv[ 1 ] );
+    find_geom();
+    convert_file( argv[ 1 ], argv[ 2 ] );
+
+    free( nib_buf );
+
+    myprintf("\n");
+
+    return 0;
+}
+
+//
+// Convert NIB image already in nib_buf and write DSK file
+// The DSK file only appears under its name once completely written
+//
+// A valid sidecar index replaces the scan; with --index a missing or
+// stale one is written once the scan has succeeded.
+//
+void convert_file( char *in, char *out )
+{
+    char idx_path[ PATH_MAX ];
+    int indexed, missing;
+
+    if ( ( outfd = atomic_create( out ) ) == -1 )
+        fatal( "cannot open %s for writing", out );
+    dsk_init();
+    reset_stats();
+
+    nibidx_path( idx_path, sizeof( idx_path ), in );
+    indexed = read_index( idx_path );
+
+    printf( "Converting %s => %s [Sectors:%d]%s\n", in, out, geom->sectors,
+        indexed ? " [Indexed]" : "" );
+
+    if ( !indexed ) {
+        if ( index_flag && nib_len == NIB_LEN ) {
+            max_idx = TRACKS_PER_DISK * ( BYTES_PER_NIB_TRACK /
+                ( sizeof( addr_t ) + PROLOG_LEN + geom->data_len ) + 1 );
+            if ( ( idx = (nibidx_entry_t *) malloc( max_idx *
+                sizeof( nibidx_entry_t ) ) ) == NULL )
+                    fatal( "cannot allocate index" );
+        }
+        convert_image();
+    }
+    dsk_write();
+    dsk_reset();
+
+    if ( ( missing = count_missing() ) > 0 )
+        printf( "Warning: %d of %d sectors not found\n", missing,
+            TRACKS_PER_DISK * geom->sectors );
+
+    if ( atomic_commit( outfd ) )
+        fatal( "cannot write %s", out );
+
+    if ( idx ) {
+        write_index( idx_path );
+        free( idx );
+        idx = NULL;
+    }
+}
+
+//
+// Decode sectors straight from the fields listed in a sidecar index
+// Returns 0 if there is no valid index for the image in nib_buf
+//
+// The index matches the NIB by length, mtime and inode, and each track's
+// fields are checked before it is decoded. Data fields are counted again
+// as they are decoded; the header holds the scan's other counts, so
+// --check gives the same summary as a scan.
+//
+int read_index( char *path )
+{
+    nibidx_header_t h;
+    nibidx_entry_t *entries;
+    int trk, volume = DEFAULT_VOLUME;
+    int len = geom->sectors * BYTES_PER_SECTOR;
+
+    if ( nib_len != NIB_LEN ||
+         ( entries = nibidx_read( path, &h, &nib_st ) ) == NULL )
+            return 0;
+    if ( h.sectors != (uint32_t) geom->sectors ) {
+        free( entries );
+        return 0;
+    }
+    nib_load();
+
+    for ( trk = 0; trk < TRACKS_PER_DISK; trk++ )
+        if ( nib_decode_indexed( geom, dsk_buf + trk * len,
+            nib_buf + trk * BYTES_PER_NIB_TRACK, trk, &volume, entries,
+            h.nentries, &found[ trk ], &stats ) ) {
+                reset_stats();
+                free( entries );
+                return 0;
+        }
+    stats.bad_addr += h.bad_addr;
+    stats.bad_epilog += h.bad_epilog;
+
+    free( entries );
+    return 1;
+}
+
+//
+// Write sidecar index of the sectors found by the scan
+//
+void write_index( char *path )
+{
+    nibidx_header_t h;
+    int fd;
+
+    memset( &h, 0, sizeof( h ) );
+    h.sectors = geom->sectors;
+    h.nentries = nidx;
+    h.bad_addr = stats.bad_addr;
+    h.bad_epilog = stats.bad_epilog;
+    nibidx_stamp( &h, &nib_st );
+
+    if ( ( fd = atomic_create( path ) ) == -1 ) {
+        printf( "Warning: cannot write index %s\n", path );
+        return;
+    }
+    if ( nibidx_write( fd, &h, idx ) ) {
+        close( fd );
+        atomic_abort();
+        printf( "Warning: cannot write index %s\n", path );
+        return;
+    }
+    if ( atomic_commit( fd ) )
+        printf( "Warning: cannot write index %s\n", path );
+}
+
+//
+// Add sector copy found by the scan to the index (--index)
+// Only standard length NIBs are indexed, so track offsets are fixed
+//
+void index_add( nib_field_t *f )
+{
+    nibidx_entry_t *e;
+    long base = (long) f->track * BYTES_PER_NIB_TRACK;
+
+    if ( idx == NULL || nidx == max_idx )
+        return;
+
+    e = &idx[ nidx++ ];
+    memset( e, 0, sizeof( nibidx_entry_t ) );
+    e->addr = base + f->addr;
+    e->data = base + f->data;
+    e->volume = f->volume;
+    e->track = f->track;
+    e->sector = f->sector;
+    if ( f->status )
+        e->flags |= NIBIDX_DATA_BAD;
+    e->copy = copies[ f->track ][ f->sector ]++;
+}
+
+//
+// Convert one NIB image of a batch into outdir (runs in a child process)
+// Returns exit status: 0 if converted
+//
+int batch_image( char *path, char *outdir )
+{
+    char out[ PATH_MAX ];
+
+    fail_path = path;
+    nib_read( path );
+    find_geom();
+
+    batch_out_path( out, sizeof( out ), outdir, path,
+        ( geom == &geom_13 ) ? ".d13" : ".dsk" );
+    convert_file( path, out );
+
+    return 0;
+}
+
+//
+// Check NIB images in parallel, one child process per image
+// Returns exit status: 0 if all images decoded cleanly
+//
+int check_images( int argc, char **argv )
+{
+    int i, status, running = 0, failed = 0;
+    long jobs = sysconf( _SC_NPROCESSORS_ONLN );
+
+    if ( jobs < 1 )
+        jobs = 1;
+
+    fflush( stdout );
+
+    for ( i = 0; i < argc; i++ ) {
+        if ( running == jobs ) {
+            wait( &status );
+            --running;
+            failed |= !WIFEXITED( status ) || WEXITSTATUS( status );
+        }
+
+        switch ( fork() ) {
+            case -1:
+                fatal( "cannot fork" );
+                break;
+            case 0:
+                exit( check_image( argv[ i ] ) );
+                break;
+            default:
+                ++running;
+                break;
+        }
+    }
+
+    while ( running-- > 0 ) {
+        wait( &status );
+        failed |= !WIFEXITED( status ) || WEXITSTATUS( status );
+    }
+
+    return failed;
+}
+
+//
+// Decode NIB image without writing anything and print a summary line
+// Returns 1 if any sector was missing or failed validation
+//
+int check_image( char *path )
+{
+    char idx_path[ PATH_MAX ];
+    int missing;
+
+    check_path = fail_path = path;
+    nib_read( path );
+    find_geom();
+    dsk_init();
+    reset_stats();
+
+    nibidx_path( idx_path, sizeof( idx_path ), path );
+    if ( !read_index( idx_path ) )
+        convert_image();
+    dsk_reset();
+
+    missing = count_missing();
+    if ( missing || stats.bad_addr || stats.bad_data || stats.bad_epilog ||
+         stats.bad_bytes ) {
+        printf( "%s: BAD %d missing, %d addr checksum, %d data checksum, "
+            "%d epilog, %d invalid bytes\n", path, missing, stats.bad_addr,
+            stats.bad_data, stats.bad_epilog, stats.bad_bytes );
+        return 1;
+    }
+
+    printf( "%s: OK\n", path );
+    return 0;
+}
+
+//
+// Convert NIB image into DSK image
+//
+// Each track of a standard length NIB is decoded on its own, by direct
+// indexing if it has the dsk2nib layout and by a scan otherwise. If the
+// NIB is still being read, a track is decoded as soon as the reader stage
+// (see pipe.h) has loaded it into nib_buf. Other lengths are scanned as a
+// whole.
+//
+void convert_image( void )
+{
+    int trk;
+
+    if ( nib_len != NIB_LEN ) {
+        myprintf( "Non-standard NIB length %ld, scanning\n", nib_len );
+        nib_decode_image( geom, dsk_buf, nib_buf, nib_len, found, &stats );
+        return;
+    }
+
+    if ( nib_fd != -1 ) {
+        if ( pipe_convert_buf( nib_fd, nib_buf, BYTES_PER_NIB_TRACK, NULL, 0,
+            TRACKS_PER_DISK, convert_track, NULL ) )
+                fatal( "read error" );
+        close( nib_fd );
+        nib_fd = -1;
+        return;
+    }
+
+    for ( trk = 0; trk < TRACKS_PER_DISK; trk++ )
+        convert_track( trk, nib_buf + trk * BYTES_PER_NIB_TRACK, NULL, NULL );
+}
+
+//
+// Convert one track of a standard length NIB (pipe_codec_t)
+//
+void convert_track( int trk, uchar *buf, uchar *unused, void *arg )
+{
+    int volume = DEFAULT_VOLUME;
+
+    (void) unused;
+    (void) arg;
+
+    found[ trk ] = nib_decode_sectors( geom,
+        dsk_buf + trk * geom->sectors * BYTES_PER_SECTOR, buf, trk, &volume,
+        &stats );
+}
+
+//
+// Report a sector copy found by the decoder (nib_stats_t callback)
+// Outside --check a non-translatable byte ends the conversion
+//
+void found_field( nib_field_t *f, void *arg )
+{
+    (void) arg;
+
+    myprintf( "V:%02x T:%02x S:%02x @%ld\n", f->volume, f->track, f->sector,
+        f->addr );
+
+    if ( f->status == NIB_BAD_BYTE && !check_path )
+        fatal( "Non-translatable byte in data field" );
+    if ( f->status == NIB_BAD_CHECKSUM && !check_path )
+        printf( "Warning: data checksum mismatch\n" );
+
+    index_add( f );
+}
+
+//
+// Clear decoder counts and sectors found
+//
+void reset_stats( void )
+{
+    memset( &stats, 0, sizeof( stats ) );
+    stats.found = found_field;
+    memset( found, 0, sizeof( found ) );
+}
+
+//
+// Return number of sectors not found with a good data checksum
+//
+int count_missing( void )
+{
+    int trk, sec, missing = 0;
+
+    for ( trk = 0; trk < TRACKS_PER_DISK; trk++ )
+        for ( sec = 0; sec < geom->sectors; sec++ )
+            missing += !( found[ trk ] & 1u << sec );
+
+    return missing;
+}
+
+//
+// Read entire NIB file into nib_buf
+//
+void nib_read( char *path )
+{
+    int fd;
+
+    if ( ( fd = open( path, O_RDONLY ) ) == -1 )
+        fatal( "cannot open %s for reading", path );
+
+    if ( fstat( fd, &nib_st ) == -1 )
+        fatal( "cannot stat %s", path );
+    pipe_readahead( fd );
+
+    nib_len = nib_st.st_size;
+    if ( ( nib_buf = (uchar *) malloc( nib_len + 1 ) ) == NULL )
+        fatal( "cannot allocate %ld bytes", nib_len );
+
+    //
+    // If track 0 of a standard length NIB gives the geometry, leave the
+    // rest to convert_image(), which decodes tracks as they are read
+    //
+    if ( nib_len == NIB_LEN ) {
+        if ( pread( fd, nib_buf, BYTES_PER_NIB_TRACK, 0 ) !=
+            BYTES_PER_NIB_TRACK )
+                fatal( "read error" );
+        if ( nib_track_geom( nib_buf ) != NULL ) {
+            nib_fd = fd;
+            return;
+        }
+    }
+
+    if ( read( fd, nib_buf, nib_len ) != nib_len )
+        fatal( "read error" );
+
+    close( fd );
+}
+
+//
+// Read the rest of a NIB that nib_read() left to convert_image()
+//
+void nib_load( void )
+{
+    long len = nib_len - BYTES_PER_NIB_TRACK;
+
+    if ( nib_fd == -1 )
+        return;
+
+    if ( pread( nib_fd, nib_buf + BYTES_PER_NIB_TRACK, len,
+        BYTES_PER_NIB_TRACK ) != len )
+            fatal( "read error" );
+
+    close( nib_fd );
+    nib_fd = -1;
+}
+
+//
+// Pick geometry from the first address prolog in the image (in track 0
+// if only that has been read)
+//
+void find_geom( void )
+{
+    geom_t *g;
+
+    if ( ( g = nib_find_geom( nib_buf,
+        ( nib_fd == -1 ) ? nib_len : BYTES_PER_NIB_TRACK ) ) != NULL )
+            geom = g;
+}
+
+//
+// Point dsk_buf into the mapped output file, so sectors are decoded in
+// place; alloc it if there is no output file or it cannot be mapped
+//
+void dsk_init( void )
+{
+    long len = TRACKS_PER_DISK * geom->sectors * BYTES_PER_SECTOR;
+
+    if ( outfd != -1 &&
+         ( dsk_map = (uchar *) atomic_map( outfd, len ) ) != NULL ) {
+            dsk_buf = dsk_map;
+            return;
+    }
+
+    if ( ( dsk_buf = (uchar *) calloc( 1, len ) ) == NULL )
+        fatal( "cannot allocate %ld bytes", len );
+}
+
+//
+// Free dsk_buf
+//
+void dsk_reset( void )
+{
+    if ( dsk_map )
+        dsk_map = NULL;
+    else
+        free( dsk_buf );
+    dsk_buf = NULL;
+}
+
+//
+// Write DSK file (or flush the mapped one)
+//
+void dsk_write( void )
+{
+    long len = TRACKS_PER_DISK * geom->sectors * BYTES_PER_SECTOR;
+
+    if ( dsk_map ) {
+        if ( atomic_unmap( dsk_map, len ) )
+            fatal( "write failure" );
+        return;
+    }
+
+    if ( write( outfd, dsk_buf, len ) != len )
+        fatal( "write failure" );
+}
+
+//
+// usage info
+//
+void usage( char *path )
+{
+    printf( "Usage: %s [--index] <nibfile> <dskfile>\n", path );
+    printf( "       %s --check <nibfile>...\n", path );
+    printf( "       %s [--index] --batch <journal> <outdir> <nibfile>...\n",
+        path );
+    printf( "Where: <nibfile> is the input NIB file name\n" );
+    printf( "       <dskfile> is the output DSK file name (D13 for 13-sector)\n" );
+    printf( "       --check decodes and validates NIB files without output\n" );
+    printf( "       --batch converts NIB files into <outdir>, skipping those\n" );
+    printf( "       already recorded in <journal> by an earlier run\n" );
+    printf( "       --index writes a sector map to <nibfile>%s, used to skip\n",
+        NIBIDX_EXT );
+    printf( "       the scan when the same NIB is converted again\n" );
+
+    exit( 1 );
+}
+
+//
+// myprintf
+//
+#pragma argsused
+void myprintf( char *format, ... )
+{
+#ifdef DEBUG
+    va_list argp;
+    va_start( argp, format );
+    vprintf( format, argp );
+    va_end( argp );
+#endif
+}
+
+//
+// fatal
+//
+void fatal( char *format, ... )
+{
+    va_list argp;
+
+    atomic_abort();
+
+    if ( fail_path )
+        printf( "%s: FAIL ", fail_path );
+    else
+        printf( "\nFatal: " );
+
+    va_start( argp, format );
+    vprintf( format, argp );
+    va_end( argp );
+
+    printf( "\n" );
+
+    exit( 1 );
+}
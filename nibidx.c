@@ -0,0 +1,119 @@
+//
+// nibidx.c - sidecar sector map for decoded NIB images
+// Copyright (C) 1996, 2017 slotek@nym.hush.com
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "codec.h"
+#include "nibidx.h"
+
+// Modification time field of struct stat
+#ifdef __APPLE__
+#define ST_MTIM             st_mtimespec
+#else
+#define ST_MTIM             st_mtim
+#endif
+
+//
+// Build index path
+//
+void nibidx_path( char *dest, int len, char *nib_path )
+{
+    snprintf( dest, len, "%s%s", nib_path, NIBIDX_EXT );
+}
+
+//
+// Stamp header with NIB file status
+//
+void nibidx_stamp( nibidx_header_t *header, struct stat *nib_st )
+{
+    header->nib_len = nib_st->st_size;
+    header->mtime_sec = nib_st->ST_MTIM.tv_sec;
+    header->mtime_nsec = nib_st->ST_MTIM.tv_nsec;
+    header->ino = nib_st->st_ino;
+}
+
+//
+// Write index
+//
+int nibidx_write( int fd, nibidx_header_t *header, nibidx_entry_t *entries )
+{
+    long len = header->nentries * sizeof( nibidx_entry_t );
+
+    memcpy( header->magic, NIBIDX_MAGIC, sizeof( header->magic ) );
+    header->version = NIBIDX_VERSION;
+    header->pad = 0;
+
+    if ( write( fd, header, sizeof( nibidx_header_t ) ) !=
+            sizeof( nibidx_header_t ) ||
+         write( fd, entries, len ) != len )
+            return -1;
+
+    return 0;
+}
+
+//
+// Read and validate index
+//
+nibidx_entry_t *nibidx_read( char *path, nibidx_header_t *header,
+    struct stat *nib_st )
+{
+    int fd;
+    uint32_t i;
+    long len;
+    struct stat st;
+    nibidx_header_t stamp;
+    nibidx_entry_t *entries, *e;
+
+    if ( ( fd = open( path, O_RDONLY ) ) == -1 )
+        return NULL;
+
+    if ( fstat( fd, &st ) == -1 ||
+         read( fd, header, sizeof( nibidx_header_t ) ) !=
+            sizeof( nibidx_header_t ) ||
+         memcmp( header->magic, NIBIDX_MAGIC, sizeof( header->magic ) ) ||
+         header->version != NIBIDX_VERSION ) {
+            close( fd );
+            return NULL;
+    }
+
+    nibidx_stamp( &stamp, nib_st );
+    if ( header->nib_len != NIB_LEN || header->nib_len != stamp.nib_len ||
+         header->mtime_sec != stamp.mtime_sec ||
+         header->mtime_nsec != stamp.mtime_nsec ||
+         header->ino != stamp.ino ) {
+            close( fd );
+            return NULL;
+    }
+
+    len = header->nentries * sizeof( nibidx_entry_t );
+    if ( st.st_size != (off_t) sizeof( nibidx_header_t ) + len ||
+         ( entries = (nibidx_entry_t *) malloc( len + 1 ) ) == NULL ) {
+            close( fd );
+            return NULL;
+    }
+
+    if ( read( fd, entries, len ) != len ) {
+        close( fd );
+        free( entries );
+        return NULL;
+    }
+    close( fd );
+
+    //
+    // Fields may wrap around the end of their track, but not the NIB
+    //
+    for ( i = 0, e = entries; i < header->nentries; i++, e++ )
+        if ( e->addr >= header->nib_len || e->data >= header->nib_len ||
+             e->track >= TRACKS_PER_DISK || e->sector >= header->sectors ) {
+                free( entries );
+                return NULL;
+        }
+
+    return entries;
+}
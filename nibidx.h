@@ -0,0 +1,89 @@
+//
+// nibidx.h - sidecar sector map for decoded NIB images
+// Copyright (C) 1996, 2017 slotek@nym.hush.com
+//
+// Once a standard length NIB has been scanned, the index <nibfile>.idx
+// records where the address and data field of every sector copy found
+// lie in the file, in scan order, so a later decode can go straight to
+// the fields. The
+// index is tied to the NIB by its length, mtime and inode number, which
+// cost nothing to check; readers still check the fields they use.
+// Integers are stored in host byte order.
+//
+#ifndef NIBIDX_H
+#define NIBIDX_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "codec.h"
+
+/********** symbolic constants **********/
+#define NIBIDX_MAGIC        "NIBINDX"
+#define NIBIDX_VERSION      3
+#define NIBIDX_EXT          ".idx"
+
+#define NIBIDX_DATA_BAD     2       // entry flags: bad data field
+
+/********** typedefs **********/
+typedef struct {
+    char magic[ 8 ];
+    uint32_t version;
+    uint32_t sectors;               // sectors per track (13 or 16)
+    uint64_t nib_len;               // NIB file length, mtime and inode
+    uint64_t mtime_sec;
+    uint64_t mtime_nsec;
+    uint64_t ino;
+    uint32_t nentries;
+    uint32_t bad_addr;              // scan counts the entries do not give
+    uint32_t bad_epilog;
+    uint32_t pad;
+} nibidx_header_t;
+
+typedef struct {
+    uint32_t addr;                  // offset of address prolog
+    uint32_t data;                  // offset of first encoded data byte
+    uint8_t volume;
+    uint8_t track;
+    uint8_t sector;
+    uint8_t flags;                  // NIBIDX_DATA_BAD
+    uint16_t copy;                  // 0 for first copy of track/sector
+    uint16_t pad;
+} nibidx_entry_t;
+
+/********** prototypes **********/
+//
+// Build index path for a NIB file into dest (len bytes)
+//
+void nibidx_path( char *dest, int len, char *nib_path );
+
+//
+// Set length, mtime and inode in header from the NIB file's status
+//
+void nibidx_stamp( nibidx_header_t *header, struct stat *nib_st );
+
+//
+// Write index to fd, opened by the caller. Returns -1 on failure.
+//
+int nibidx_write( int fd, nibidx_header_t *header, nibidx_entry_t *entries );
+
+//
+// Read index into *header and return its malloc()ed entries, or NULL if
+// missing, malformed or stamped for another NIB than nib_st. Only
+// standard length NIBs are indexed; the caller checks sectors.
+//
+nibidx_entry_t *nibidx_read( char *path, nibidx_header_t *header,
+    struct stat *nib_st );
+
+//
+// Decode NIB track (see nib_decode_sectors()) from the fields the index
+// entries list, replaying them in scan order. *found gets the bit mask of
+// the sectors found. Only data fields are counted in stats; the header
+// holds the rest of the scan's counts. Returns -1, having decoded nothing,
+// if a field of the track is not where its entry says.
+//
+int nib_decode_indexed( geom_t *geom, uchar *dsk, uchar *nib, int track,
+    int *volume, nibidx_entry_t *idx, uint32_t nidx, unsigned *found,
+    nib_stats_t *stats );
+
+#endif
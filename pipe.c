@@ -0,0 +1,262 @@
+//
+// pipe.c - overlap reading, converting and writing of image tracks
+// Copyright (C) 1996, 2017 slotek@nym.hush.com
+//
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "pipe.h"
+
+/********** typedefs **********/
+typedef struct {
+    int infd, outfd;
+    int in_len, out_len;
+    int tracks;
+    unsigned char *in[ PIPE_DEPTH ];
+    unsigned char *out[ PIPE_DEPTH ];
+    unsigned char *in_buf, *out_buf;    // whole image buffers, or NULL
+
+    //
+    // Tracks finished by each stage; track t uses slot t % PIPE_DEPTH,
+    // which is free again once track t - PIPE_DEPTH has been written
+    // (converted, if there is no writer)
+    //
+    int nread, ncoded, nwritten;
+    int *nfreed;
+    int error;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} pipe_t;
+
+/********** prototypes **********/
+static int run( pipe_t *p, pipe_codec_t codec, void *arg );
+static unsigned char *in_slot( pipe_t *p, int track );
+static unsigned char *out_slot( pipe_t *p, int track );
+static void *reader( void *arg );
+static void *writer( void *arg );
+static int wait_for( pipe_t *p, int *count, int need );
+static void done( pipe_t *p, int *count, int ok );
+static int io_full( int fd, unsigned char *buf, int len, int writing );
+
+//
+// Run the pipeline with a writer
+//
+int pipe_convert( int infd, int in_len, int outfd, int out_len, int tracks,
+    pipe_codec_t codec, void *arg )
+{
+    pipe_t p;
+
+    memset( &p, 0, sizeof( p ) );
+    p.infd = infd;
+    p.outfd = outfd;
+    p.in_len = in_len;
+    p.out_len = out_len;
+    p.tracks = tracks;
+
+    return run( &p, codec, arg );
+}
+
+//
+// Run the pipeline without a writer
+//
+int pipe_convert_buf( int infd, unsigned char *in, int in_len,
+    unsigned char *out, int out_len, int tracks, pipe_codec_t codec,
+    void *arg )
+{
+    pipe_t p;
+
+    memset( &p, 0, sizeof( p ) );
+    p.infd = infd;
+    p.outfd = -1;
+    p.in_len = in_len;
+    p.out_len = out_len;
+    p.tracks = tracks;
+    p.in_buf = in;
+    p.out_buf = out;
+
+    return run( &p, codec, arg );
+}
+
+//
+// Start the reader (and writer, if there is an outfd) and convert tracks
+// as they arrive
+//
+static int run( pipe_t *p, pipe_codec_t codec, void *arg )
+{
+    int i, t, error;
+    pthread_t rd, wr;
+
+    p->nfreed = ( p->outfd == -1 ) ? &p->ncoded : &p->nwritten;
+
+    for ( i = 0; i < PIPE_DEPTH; i++ )
+        if ( ( p->in_buf == NULL && ( p->in[ i ] =
+                (unsigned char *) malloc( p->in_len ) ) == NULL ) ||
+             ( p->outfd != -1 && ( p->out[ i ] =
+                (unsigned char *) malloc( p->out_len ) ) == NULL ) )
+                    p->error = 1;
+
+    pthread_mutex_init( &p->lock, NULL );
+    pthread_cond_init( &p->cond, NULL );
+    pipe_readahead( p->infd );
+
+    if ( !p->error ) {
+        if ( pthread_create( &rd, NULL, reader, p ) )
+            p->error = 1;
+        else if ( p->outfd != -1 &&
+            pthread_create( &wr, NULL, writer, p ) ) {
+                done( p, &p->ncoded, 0 );
+                pthread_join( rd, NULL );
+        } else {
+
+            //
+            // Convert tracks as they arrive
+            //
+            for ( t = 0; t < p->tracks; t++ ) {
+                if ( wait_for( p, &p->nread, t + 1 ) )
+                    break;
+                codec( t, in_slot( p, t ), out_slot( p, t ), arg );
+                done( p, &p->ncoded, 1 );
+            }
+
+            pthread_join( rd, NULL );
+            if ( p->outfd != -1 )
+                pthread_join( wr, NULL );
+        }
+    }
+
+    error = p->error;
+    for ( i = 0; i < PIPE_DEPTH; i++ ) {
+        free( p->in[ i ] );
+        free( p->out[ i ] );
+    }
+    pthread_mutex_destroy( &p->lock );
+    pthread_cond_destroy( &p->cond );
+
+    return error ? -1 : 0;
+}
+
+//
+// Return input buffer of a track
+//
+static unsigned char *in_slot( pipe_t *p, int track )
+{
+    if ( p->in_buf )
+        return p->in_buf + (long) track * p->in_len;
+
+    return p->in[ track % PIPE_DEPTH ];
+}
+
+//
+// Return output buffer of a track, or NULL if there is none
+//
+static unsigned char *out_slot( pipe_t *p, int track )
+{
+    if ( p->out_buf )
+        return p->out_buf + (long) track * p->out_len;
+    if ( p->outfd == -1 )
+        return NULL;
+
+    return p->out[ track % PIPE_DEPTH ];
+}
+
+//
+// Advise sequential read of whole file
+//
+void pipe_readahead( int fd )
+{
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise( fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+    posix_fadvise( fd, 0, 0, POSIX_FADV_WILLNEED );
+#else
+    (void) fd;
+#endif
+}
+
+//
+// Reader stage
+//
+static void *reader( void *arg )
+{
+    pipe_t *p = (pipe_t *) arg;
+    int t;
+
+    for ( t = 0; t < p->tracks; t++ ) {
+        if ( p->in_buf == NULL &&
+             wait_for( p, p->nfreed, t - PIPE_DEPTH + 1 ) )
+                break;
+        done( p, &p->nread, io_full( p->infd, in_slot( p, t ), p->in_len,
+            0 ) == 0 );
+    }
+
+    return NULL;
+}
+
+//
+// Writer stage
+//
+static void *writer( void *arg )
+{
+    pipe_t *p = (pipe_t *) arg;
+    int t;
+
+    for ( t = 0; t < p->tracks; t++ ) {
+        if ( wait_for( p, &p->ncoded, t + 1 ) )
+            break;
+        done( p, &p->nwritten, io_full( p->outfd, out_slot( p, t ),
+            p->out_len, 1 ) == 0 );
+    }
+
+    return NULL;
+}
+
+//
+// Wait until a stage has finished need tracks
+// Returns -1 if the pipeline failed meanwhile
+//
+static int wait_for( pipe_t *p, int *count, int need )
+{
+    int error;
+
+    pthread_mutex_lock( &p->lock );
+    while ( *count < need && !p->error )
+        pthread_cond_wait( &p->cond, &p->lock );
+    error = p->error;
+    pthread_mutex_unlock( &p->lock );
+
+    return error ? -1 : 0;
+}
+
+//
+// Mark one more track finished by a stage, or the pipeline failed
+//
+static void done( pipe_t *p, int *count, int ok )
+{
+    pthread_mutex_lock( &p->lock );
+    if ( ok )
+        ++*count;
+    else
+        p->error = 1;
+    pthread_cond_broadcast( &p->cond );
+    pthread_mutex_unlock( &p->lock );
+}
+
+//
+// Read or write exactly len bytes
+//
+static int io_full( int fd, unsigned char *buf, int len, int writing )
+{
+    int n;
+
+    while ( len > 0 ) {
+        n = writing ? write( fd, buf, len ) : read( fd, buf, len );
+        if ( n <= 0 )
+            return -1;
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
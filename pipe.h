@@ -0,0 +1,50 @@
+//
+// pipe.h - overlap reading, converting and writing of image tracks
+// Copyright (C) 1996, 2017 slotek@nym.hush.com
+//
+// A reader thread reads input tracks and a writer thread writes output
+// tracks, while the calling thread converts them. The stages hand track
+// buffers around a ring of PIPE_DEPTH slots, so while track N is being
+// converted track N+1 is already loading and track N-1 is being written.
+//
+// pipe_convert_buf() runs the reader and converter only: input may be
+// read into a caller's buffer holding the whole image, and output goes
+// straight into a caller's buffer (e.g. a mapped output file).
+//
+#ifndef PIPE_H
+#define PIPE_H
+
+/********** symbolic constants **********/
+#define PIPE_DEPTH          4       // track slots in the ring
+
+/********** typedefs **********/
+typedef void (*pipe_codec_t)( int track, unsigned char *in,
+    unsigned char *out, void *arg );
+
+/********** prototypes **********/
+//
+// Read tracks of in_len bytes from infd, convert each with
+// codec(track, in, out, arg) and write tracks of out_len bytes to outfd.
+// Returns -1 on a read error, short input or write error.
+//
+int pipe_convert( int infd, int in_len, int outfd, int out_len, int tracks,
+    pipe_codec_t codec, void *arg );
+
+//
+// Read tracks of in_len bytes from infd and convert each with
+// codec(track, in, out, arg) as it arrives. If in is not NULL track t is
+// read to in + t * in_len, otherwise into a ring slot. If out is not
+// NULL the codec gets out + t * out_len, otherwise NULL.
+// Returns -1 on a read error or short input.
+//
+int pipe_convert_buf( int infd, unsigned char *in, int in_len,
+    unsigned char *out, int out_len, int tracks, pipe_codec_t codec,
+    void *arg );
+
+//
+// Tell the kernel a file will be read sequentially and soon
+// (posix_fadvise(), where available)
+//
+void pipe_readahead( int fd );
+
+#endif